@@ -17,50 +17,447 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include "fdns.h"
+#include "lint.h"
 
-// debug statistics
-//#define DEBUG_STATS
-#ifdef DEBUG_STATS
-static unsigned sentries = 0;	// entries
-static unsigned scnt = 0;		// print counter
-#endif
+// memory statistics, printed in debug mode
+#define CACHE_STATS_TIMER 60
+static WheelTimer stats_timer;
 
+// the name and the reply are stored at their real size
 typedef struct cache_entry_t {
+	WheelTimer timer;	// the entry is removed when the timer expires
+	struct cache_entry_t *prev;	// LRU list
 	struct cache_entry_t *next;
-	int16_t  ttl;
-	uint16_t len;
-	int type; // 0 - ipv4,, 1 - ipv6
-	char name[CACHE_NAME_LEN + 1];
-#define MAX_REPLY 900
-	uint8_t reply[MAX_REPLY];
-} CacheEntry;	// not more than 1024
-
-#define MAX_HASH_ARRAY 256
-static CacheEntry *clist[MAX_HASH_ARRAY];
-static char cname[CACHE_NAME_LEN + 1] = {0};
-static int cname_type=0;	// 0 - ipv4, 1 - ipv6
-static uint8_t creply[MAX_REPLY];
+	uint32_t stored;	// time the reply was cached in seconds, the TTLs in the reply are counted down from here
+	uint32_t hash;
+	uint16_t len;	// reply length
+	uint8_t type; // 0 - ipv4,, 1 - ipv6
+	uint8_t nlen;	// name length
+	uint8_t lru;	// LRU list
+	uint8_t data[];	// name, '\0', reply
+} CacheEntry;
+
+static inline char *entry_name(CacheEntry *e) {
+	return (char *) e->data;
+}
+
+static inline uint8_t *entry_reply(CacheEntry *e) {
+	return e->data + e->nlen + 1;
+}
+
+static inline unsigned entry_size(unsigned nlen, unsigned len) {
+	return sizeof(CacheEntry) + nlen + 1 + len;
+}
+
+// slab allocator: the entries are carved out of CACHE_SLAB_PAGE pages, each page is split
+// in chunks of the same size; the free chunks of a size class are kept in a list and reused
+// by the next entries of that class
+#define CACHE_SLAB_PAGE (64 * 1024)
+static const unsigned slab_size[] = {64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 2560};
+#define SLAB_CLASSES ((int) (sizeof(slab_size) / sizeof(slab_size[0])))
+
+typedef struct slab_class_t {
+	void *free;	// free chunks, linked through their first bytes
+	unsigned pages;	// pages allocated for this class
+	unsigned used;	// chunks in use
+	size_t bytes;	// bytes stored in the chunks in use
+} SlabClass;
+static SlabClass slab[SLAB_CLASSES];
+
+static inline int slab_class(unsigned size) {
+	int i;
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		if (size <= slab_size[i])
+			return i;
+	}
+	assert(0);
+	return -1;
+}
+
+static void *slab_alloc(unsigned size) {
+	int c = slab_class(size);
+	SlabClass *sc = &slab[c];
+	if (!sc->free) {
+		uint8_t *page = malloc(CACHE_SLAB_PAGE);
+		if (!page)
+			errExit("malloc");
+		sc->pages++;
+		unsigned cnt = CACHE_SLAB_PAGE / slab_size[c];
+		unsigned i;
+		for (i = 0; i < cnt; i++) {
+			void **chunk = (void **) (page + i * slab_size[c]);
+			*chunk = sc->free;
+			sc->free = chunk;
+		}
+	}
+
+	void **chunk = sc->free;
+	sc->free = *chunk;
+	sc->used++;
+	sc->bytes += size;
+	return chunk;
+}
+
+static void slab_free(void *ptr, unsigned size) {
+	SlabClass *sc = &slab[slab_class(size)];
+	assert(sc->used);
+	*(void **) ptr = sc->free;
+	sc->free = ptr;
+	sc->used--;
+	sc->bytes -= size;
+}
+
+// memory taken by the entry
+static inline unsigned entry_cost(CacheEntry *e) {
+	return slab_size[slab_class(entry_size(e->nlen, e->len))];
+}
+
+// W-TinyLFU (Einziger, Friedman, Manes): the new entries go in a small LRU window, and the
+// main area is a segmented LRU split in probation and protected; an entry leaving the window
+// is admitted in the main area only if it was requested more often than the entry it pushes out,
+// as estimated by a count-min sketch of the recent requests - the one-off names coming in
+// from crawlers never push out the working set
+#define CACHE_WINDOW_PCT 1	// window size, percent of --cache-size
+#define CACHE_PROTECTED_PCT 80	// protected segment size, percent of the main area
+typedef enum {
+	LRU_WINDOW = 0,
+	LRU_PROBATION,	// admitted in the main area, not requested since
+	LRU_PROTECTED,	// requested again while in the main area
+	LRU_MAX
+} LruType;
+
+typedef struct lru_t {
+	CacheEntry *head;	// most recently used
+	CacheEntry *tail;
+	size_t bytes;
+} Lru;
+static Lru lru[LRU_MAX];
+
+static void lru_unlink(CacheEntry *e) {
+	Lru *l = &lru[e->lru];
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		l->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		l->tail = e->prev;
+	l->bytes -= entry_cost(e);
+}
+
+static void lru_push(CacheEntry *e, LruType type) {
+	Lru *l = &lru[type];
+	e->lru = type;
+	e->prev = NULL;
+	e->next = l->head;
+	if (l->head)
+		l->head->prev = e;
+	else
+		l->tail = e;
+	l->head = e;
+	l->bytes += entry_cost(e);
+}
+
+static inline size_t cache_bytes(void) {
+	return lru[LRU_WINDOW].bytes + lru[LRU_PROBATION].bytes + lru[LRU_PROTECTED].bytes;
+}
+
+// count-min sketch: SKETCH_DEPTH rows of 4-bit counters, stored in bytes; the counters are
+// halved after every sample of 10 requests per counter, the old popularity fades out
+#define SKETCH_DEPTH 4
+#define SKETCH_COUNTER_MAX 15
+#define CACHE_ENTRY_AVG 128	// average entry size, the sketch is sized for --cache-size / CACHE_ENTRY_AVG names
+static uint8_t *sketch = NULL;
+static uint32_t sketch_width = 0;	// counters in a row, a power of 2
+static uint32_t sketch_adds = 0;	// increments since the counters were halved
+static const uint32_t sketch_seed[SKETCH_DEPTH] = {0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f};
+
+static void sketch_init(void) {
+	size_t names = ((size_t) arg_cache_size * 1024 * 1024) / CACHE_ENTRY_AVG;
+	sketch_width = 1024;
+	while (sketch_width < names)
+		sketch_width *= 2;
+	sketch = calloc(SKETCH_DEPTH, sketch_width);
+	if (!sketch)
+		errExit("calloc");
+	sketch_adds = 0;
+}
+
+static inline uint8_t *sketch_counter(uint32_t h, int row) {
+	uint32_t x = h * sketch_seed[row];
+	return sketch + row * sketch_width + ((x ^ (x >> 16)) & (sketch_width - 1));
+}
+
+static void sketch_add(uint32_t h) {
+	if (!sketch)
+		sketch_init();
+	int added = 0;
+	int i;
+	for (i = 0; i < SKETCH_DEPTH; i++) {
+		uint8_t *c = sketch_counter(h, i);
+		if (*c < SKETCH_COUNTER_MAX) {
+			(*c)++;
+			added = 1;
+		}
+	}
+
+	if (added && ++sketch_adds >= sketch_width * 10) {
+		uint32_t j;
+		for (j = 0; j < SKETCH_DEPTH * sketch_width; j++)
+			sketch[j] >>= 1;
+		sketch_adds /= 2;
+	}
+}
 
-static inline void clean_entry(CacheEntry *ptr) {
-	ptr->next = NULL;
-	ptr->ttl = 0;
-	ptr->type = 0;
-	ptr->name[0] = '\0';
+static unsigned sketch_freq(uint32_t h) {
+	if (!sketch)
+		return 0;
+	unsigned freq = SKETCH_COUNTER_MAX;
+	int i;
+	for (i = 0; i < SKETCH_DEPTH; i++) {
+		uint8_t *c = sketch_counter(h, i);
+		if (*c < freq)
+			freq = *c;
+	}
+	return freq;
 }
 
-// djb2 hash function by Dan Bernstein
-static inline int hash(const char *str, int type) {
-	uint32_t hash = 5381;
+static void entry_free(CacheEntry *e) {
+	wheel_del(&e->timer);
+	lru_unlink(e);
+	slab_free(e, entry_size(e->nlen, e->len));
+}
+
+// open addressing hash table with Robin Hood linear probing; the hashes are stored apart from
+// the entries, a lookup reads one or two cache lines of hashes and touches only the matching entry
+#define CACHE_TABLE_MIN 256	// initial table size, a power of 2
+static uint32_t *chash = NULL;	// hash of each slot, 0 if the slot is empty
+static CacheEntry **centry = NULL;
+static uint32_t csize = 0;	// number of slots
+static uint32_t ccnt = 0;	// entries in the table
+static char cname[CACHE_NAME_LEN + 1] = {0};
+static int cname_type=0;	// 0 - ipv4, 1 - ipv6
+static uint8_t creply[MAXBUF];
+
+// FNV-1a hash of the name and type, never 0
+static inline uint32_t hash(const char *str, int type) {
+	uint32_t h = 2166136261u;
 	int c;
 
 	while ((c = *str++) != '\0')
-		hash = ((hash << 5) + hash) ^ c; // hash * 33 ^ c
+		h = (h ^ (uint8_t) c) * 16777619u;
+	h = (h ^ (uint8_t) type) * 16777619u;
+	return (h) ? h : 1;
+}
+
+// distance of slot i from the home slot of hash h
+static inline uint32_t probe_dist(uint32_t h, uint32_t i) {
+	return (i - h) & (csize - 1);
+}
 
-	return (int) ((hash & (MAX_HASH_ARRAY - 1)) ^ type);
+static void table_alloc(uint32_t size) {
+	chash = calloc(size, sizeof(uint32_t));
+	centry = calloc(size, sizeof(CacheEntry *));
+	if (!chash || !centry)
+		errExit("calloc");
+	csize = size;
+	ccnt = 0;
+}
+
+// Robin Hood insertion: the entry takes the slot of any entry closer to its home slot,
+// and the displaced entry moves on
+static void table_insert(uint32_t h, CacheEntry *e) {
+	uint32_t mask = csize - 1;
+	uint32_t i = h & mask;
+	uint32_t dist = 0;
+	while (chash[i]) {
+		uint32_t d = probe_dist(chash[i], i);
+		if (d < dist) {
+			uint32_t th = chash[i];
+			CacheEntry *te = centry[i];
+			chash[i] = h;
+			centry[i] = e;
+			h = th;
+			e = te;
+			dist = d;
+		}
+		i = (i + 1) & mask;
+		dist++;
+	}
+	chash[i] = h;
+	centry[i] = e;
+	ccnt++;
+}
+
+// double the table size when it is 3/4 full
+static void table_grow(void) {
+	uint32_t *oldhash = chash;
+	CacheEntry **oldentry = centry;
+	uint32_t oldsize = csize;
+	table_alloc(csize * 2);
+
+	uint32_t i;
+	for (i = 0; i < oldsize; i++) {
+		if (oldhash[i])
+			table_insert(oldhash[i], oldentry[i]);
+	}
+	free(oldhash);
+	free(oldentry);
+}
+
+// remove the entry in slot i, the entries that follow are shifted back
+static void table_remove(uint32_t i) {
+	uint32_t mask = csize - 1;
+	entry_free(centry[i]);
+	ccnt--;
+
+	uint32_t next = (i + 1) & mask;
+	while (chash[next] && probe_dist(chash[next], next) != 0) {
+		chash[i] = chash[next];
+		centry[i] = centry[next];
+		i = next;
+		next = (next + 1) & mask;
+	}
+	chash[i] = 0;
+	centry[i] = NULL;
+}
+
+// returns the slot, -1 if not found
+static int table_find(const char *name, int type, uint32_t h) {
+	uint32_t mask = csize - 1;
+	uint32_t i = h & mask;
+	uint32_t dist = 0;
+	while (chash[i] && probe_dist(chash[i], i) >= dist) {
+		if (chash[i] == h && centry[i]->type == type && strcmp(entry_name(centry[i]), name) == 0)
+			return (int) i;
+		i = (i + 1) & mask;
+		dist++;
+	}
+	return -1;
+}
+
+static void cache_remove(CacheEntry *e) {
+	uint32_t mask = csize - 1;
+	uint32_t i = e->hash & mask;
+	while (centry[i] != e) {
+		assert(chash[i]);
+		i = (i + 1) & mask;
+	}
+	table_remove(i);
+}
+
+// the entry expired
+static void cache_expire(WheelTimer *t) {
+	cache_remove((CacheEntry *) ((char *) t - offsetof(CacheEntry, timer)));
+}
+
+// the least recently used entry in the main area, NULL if the main area is empty
+static CacheEntry *main_victim(void) {
+	if (lru[LRU_PROBATION].tail)
+		return lru[LRU_PROBATION].tail;
+	return lru[LRU_PROTECTED].tail;
+}
+
+// bring the cache back under --cache-size
+static void cache_evict(void) {
+	size_t max = (size_t) arg_cache_size * 1024 * 1024;
+	size_t window_max = max * CACHE_WINDOW_PCT / 100;
+
+	// the entries leaving the window compete with the main area victims
+	while (lru[LRU_WINDOW].bytes > window_max) {
+		CacheEntry *c = lru[LRU_WINDOW].tail;
+		lru_unlink(c);
+		unsigned cost = entry_cost(c);
+		unsigned freq = sketch_freq(c->hash);
+		CacheEntry *victim;
+		while (cache_bytes() + cost > max && (victim = main_victim()) != NULL &&
+		       freq > sketch_freq(victim->hash)) {
+			cache_remove(victim);
+			stats.cache_evict++;
+		}
+
+		if (cache_bytes() + cost > max) {
+			// not popular enough
+			lru_push(c, LRU_WINDOW);
+			cache_remove(c);
+			stats.cache_reject++;
+		}
+		else {
+			lru_push(c, LRU_PROBATION);
+			stats.cache_admit++;
+		}
+	}
+
+	// a large entry can still leave us over the limit
+	while (cache_bytes() > max) {
+		CacheEntry *victim = main_victim();
+		if (!victim)
+			victim = lru[LRU_WINDOW].tail;
+		cache_remove(victim);
+		stats.cache_evict++;
+	}
+}
+
+// the entry was requested
+static void cache_touch(CacheEntry *e) {
+	if (e->lru == LRU_WINDOW) {
+		lru_unlink(e);
+		lru_push(e, LRU_WINDOW);
+		return;
+	}
+
+	lru_unlink(e);
+	lru_push(e, LRU_PROTECTED);
+
+	// the protected segment overflows in probation
+	size_t max = (size_t) arg_cache_size * 1024 * 1024;
+	size_t protected_max = (max - max * CACHE_WINDOW_PCT / 100) * CACHE_PROTECTED_PCT / 100;
+	while (lru[LRU_PROTECTED].bytes > protected_max && lru[LRU_PROTECTED].tail != e) {
+		CacheEntry *p = lru[LRU_PROTECTED].tail;
+		lru_unlink(p);
+		lru_push(p, LRU_PROBATION);
+	}
+}
+
+// memory used by the cache, by size class; printed at most once a minute while
+// the responses come in
+static void print_stats(WheelTimer *t) {
+	(void) t;
+	size_t table = (size_t) csize * (sizeof(uint32_t) + sizeof(CacheEntry *));
+	size_t total = table;
+	int i;
+	for (i = 0; i < SLAB_CLASSES; i++)
+		total += (size_t) slab[i].pages * CACHE_SLAB_PAGE;
+
+	printf("(%d) cache: %u entries, table %u slots %zu KB, total %zu KB\n", arg_id, ccnt, csize, table / 1024, total / 1024);
+	printf("(%d) cache: window %zu KB, probation %zu KB, protected %zu KB, limit %d MB\n", arg_id,
+	       lru[LRU_WINDOW].bytes / 1024, lru[LRU_PROBATION].bytes / 1024, lru[LRU_PROTECTED].bytes / 1024,
+	       arg_cache_size);
+	for (i = 0; i < SLAB_CLASSES; i++) {
+		SlabClass *sc = &slab[i];
+		if (sc->pages == 0)
+			continue;
+		unsigned cnt = sc->pages * (CACHE_SLAB_PAGE / slab_size[i]);
+		printf("(%d)    %4u bytes: %u/%u chunks, %u KB, %zu bytes stored\n", arg_id, slab_size[i],
+		       sc->used, cnt, sc->pages * CACHE_SLAB_PAGE / 1024, sc->bytes);
+	}
+	fflush(0);
 }
 
 void cache_init(void) {
-	memset(&clist[0], 0, sizeof(clist));
+	// drop all the entries
+	uint32_t i;
+	for (i = 0; i < csize; i++) {
+		if (chash[i])
+			entry_free(centry[i]);
+	}
+	free(chash);
+	free(centry);
+	table_alloc(CACHE_TABLE_MIN);
+	memset(lru, 0, sizeof(lru));
+	free(sketch);
+	sketch = NULL;	// allocated on first use, after --cache-size was parsed
 	memset(cname, 0, sizeof(cname));
 }
 
@@ -71,106 +468,80 @@ void cache_set_name(const char *name, int ipv6) {
 	cname_type = ipv6;
 }
 
-char* cache_get_name() {
-	char* blah = (char*)malloc(sizeof(char)*100);
-	strcpy(blah, cname);
-	return blah;
-}
-
-int cache_get_name_type() {
-	return cname_type;
+// name set by the DNS parser for the current request, empty if the response should not be cached
+const char *cache_get_name(int *ipv6) {
+	assert(ipv6);
+	*ipv6 = cname_type;
+	return cname;
 }
 
+// ttl is the smallest TTL in the reply, bounded here by --cache-min-ttl and --cache-ttl
 void cache_set_reply(uint8_t *reply, ssize_t len, int ttl) {
 	assert(reply);
-	assert(ttl > 0);
-	
-	if (len == 0 || len > MAX_REPLY || *cname == '\0') {
+	assert(ttl >= 0);
+	if (ttl < arg_cache_min_ttl)
+		ttl = arg_cache_min_ttl;
+	if (ttl > arg_cache_ttl)
+		ttl = arg_cache_ttl;
+
+	if (len == 0 || len > arg_cache_max_reply || *cname == '\0' || ttl == 0) {
 		*cname = '\0';
 		return;
 	}
 
-	int h = hash(cname, cname_type);
-	CacheEntry *ptr = malloc(sizeof(CacheEntry));
-	if (!ptr)
-		errExit("malloc");
-	clean_entry(ptr);
-#ifdef DEBUG_STATS
-	sentries++;
-#endif
+	unsigned nlen = strlen(cname);
+	CacheEntry *ptr = slab_alloc(entry_size(nlen, len));
 	ptr->len = len;
 	ptr->type = cname_type;
-	assert(sizeof(cname) == sizeof(ptr->name));
-	memcpy(ptr->name, cname, sizeof(cname));
-	memcpy(ptr->reply, reply, len);
-	ptr->ttl = (int16_t) ttl;
+	ptr->nlen = nlen;
+	memcpy(entry_name(ptr), cname, nlen + 1);
+	memcpy(entry_reply(ptr), reply, len);
+	ptr->stored = (uint32_t) (event_clock() / 1000);
+	memset(&ptr->timer, 0, sizeof(ptr->timer));
+	wheel_add(&ptr->timer, ttl, cache_expire);
 
-	ptr->next = clist[h];
-	clist[h] = ptr;
+	// a newer response replaces the old one
+	uint32_t h = hash(cname, cname_type);
+	ptr->hash = h;
+	int i = table_find(cname, cname_type, h);
+	if (i != -1)
+		table_remove(i);
+	if ((ccnt + 1) * 4 > csize * 3)
+		table_grow();
+	table_insert(h, ptr);
+	lru_push(ptr, LRU_WINDOW);
+	cache_evict();
 	*cname = '\0';
+
+	if (arg_debug && !stats_timer.pprev)
+		wheel_add(&stats_timer, CACHE_STATS_TIMER, print_stats);
 }
 
 
 uint8_t *cache_check(uint16_t id, const char *name, ssize_t *lenptr, int ipv6) {
 	assert(name);
 	printf("checking for name %s\n", name);
-	int h = hash(name, ipv6);
-	CacheEntry *ptr = clist[h];
-	while (ptr) {
-		if (strcmp(ptr->name, name) == 0 && ptr->type == ipv6) {
-			// store the reply locally
-			assert(ptr->len);
-			assert(ptr->len < MAX_REPLY);
-			memcpy(creply, ptr->reply, ptr->len);
-			// set id
-			id = htons(id);
-			memcpy(creply, &id, 2);
-			// set length
-			*lenptr = ptr->len;
-
-			return creply;
-		}
-
-		ptr = ptr->next;
+	uint32_t h = hash(name, ipv6);
+	sketch_add(h);
+	int i = table_find(name, ipv6, h);
+	if (i == -1) {
+		stats.cache_miss++;
+		return NULL;
 	}
 
-	return NULL;
-}
+	// store the reply locally
+	CacheEntry *ptr = centry[i];
+	cache_touch(ptr);
+	assert(ptr->len);
+	assert(ptr->len <= sizeof(creply));
+	memcpy(creply, entry_reply(ptr), ptr->len);
+	// the clients see the time left for each record
+	lint_ttl_update(creply, ptr->len, (uint32_t) (event_clock() / 1000) - ptr->stored);
+	// set id
+	id = htons(id);
+	memcpy(creply, &id, 2);
+	// set length
+	*lenptr = ptr->len;
 
-void cache_timeout(void) {
-	int i;
-
-	for (i = 0; i < MAX_HASH_ARRAY; i++) {
-		CacheEntry *ptr = clist[i];
-		CacheEntry *last = NULL;
-
-		while (ptr) {
-			ptr->ttl--;
-			if (ptr->ttl <= 0) {
-				if (last == NULL)
-					clist[i] = ptr->next;
-				else
-					last->next = ptr->next;
-				CacheEntry *tmp = ptr;
-				ptr = ptr->next;
-				free(tmp);
-#ifdef DEBUG_STATS
-				sentries--;
-#endif
-			}
-			else {
-				last = ptr;
-				ptr = ptr->next;
-			}
-		}
-	}
-
-#ifdef DEBUG_STATS
-	scnt++;
-	if (scnt >= 60) {
-		printf("*** (%d) cache entries %u, mem %lu, cache ttl %d\n", arg_id, sentries, (unsigned) sentries * sizeof(CacheEntry) + (unsigned) sizeof(clist), arg_cache_ttl);
-		fflush(0);
-		scnt = 0;
-	}
-#endif
+	return creply;
 }
@@ -23,7 +23,7 @@
 typedef struct db_elem_t {
 	uint8_t active;
 #define MAX_TIMEOUT 64 // clear the element if no response back in MAX_TIMEOUT seconds
-	uint8_t timeout;
+	WheelTimer timer;
 #define ID_SIZE 2 	// 2 bytes matching DNS id
 	uint8_t *buf[ID_SIZE];
 	struct db_elem_t *next;
@@ -37,6 +37,12 @@ void dnsdb_init(void) {
 	memset(&db[0], 0, sizeof(db));
 }
 
+// no response for this request
+static void dnsdb_expire(WheelTimer *t) {
+	DbElem *ptr = (DbElem *) ((char *) t - offsetof(DbElem, timer));
+	ptr->active = 0;
+}
+
 static inline int hash(const uint8_t *buf) {
 	uint8_t h = 0xac;
 	int i;
@@ -59,6 +65,7 @@ struct sockaddr_in *dnsdb_retrieve(uint8_t *buf) {
 	do {
 		if (ptr->active && memcmp(ptr->buf, buf, ID_SIZE) == 0) {
 			ptr->active = 0;
+			wheel_del(&ptr->timer);
 			return &ptr->addr;
 		}
 		ptr = ptr->next;
@@ -108,20 +115,6 @@ void dnsdb_store(uint8_t *buf, struct sockaddr_in *addr) {
 	memcpy(found->buf, buf, ID_SIZE);
 	memcpy(&found->addr, addr, sizeof(struct sockaddr_in));
 	found->active = 1;
-	found->timeout = MAX_TIMEOUT;
-}
-
-void dnsdb_timeout(void) {
-	int i;
-	for (i = 0; i < MAX_HASH_ARRAY; i++) {
-		DbElem *ptr = &db[i];
-		while (ptr) {
-			if (ptr->active) {
-				if (--ptr->timeout <= 0)
-					ptr->active = 0;
-			}
-			ptr = ptr->next;
-		}
-	}
+	wheel_add(&found->timer, MAX_TIMEOUT, dnsdb_expire);
 }
 
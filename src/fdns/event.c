@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2019-2020 FDNS Authors
+ *
+ * This file is part of fdns project
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "fdns.h"
+#include <errno.h>
+#include <time.h>
+
+// epoll event loop used by the frontend and by the resolver processes;
+// the file descriptors are registered once, and the handlers are called
+// as the data comes in
+
+typedef struct event_t {
+	EventHandler handler;	// NULL if the file descriptor is not registered
+	void *arg;
+	uint32_t events;
+} Event;
+
+static int epfd = -1;
+static Event *ev = NULL;	// indexed by file descriptor
+static int ev_max = 0;
+static double tick = 0;	// time of the next one-second tick
+static double wakeup = 0;	// earlier wakeup requested for the next wait, 0 if none
+#define EVENT_BATCH 64	// events processed in one epoll_wait call
+
+static void event_init(void) {
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		errExit("epoll_create1");
+	tick = event_clock() + 1000;
+}
+
+// monotonic time in milliseconds
+double event_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1000 + (double) ts.tv_nsec / 1000000;
+}
+
+void event_add(int fd, uint32_t events, EventHandler handler, void *arg) {
+	assert(fd >= 0);
+	assert(handler);
+	if (epfd == -1)
+		event_init();
+
+	if (fd >= ev_max) {
+		int max = fd + 64;
+		ev = realloc(ev, max * sizeof(Event));
+		if (!ev)
+			errExit("realloc");
+		memset(ev + ev_max, 0, (max - ev_max) * sizeof(Event));
+		ev_max = max;
+	}
+
+	struct epoll_event e;
+	memset(&e, 0, sizeof(e));
+	e.events = events;
+	e.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) == -1)
+		errExit("epoll_ctl");
+	ev[fd].handler = handler;
+	ev[fd].arg = arg;
+	ev[fd].events = events;
+}
+
+// change the events we are waiting for
+void event_mod(int fd, uint32_t events) {
+	assert(fd >= 0 && fd < ev_max);
+	assert(ev[fd].handler);
+	if (ev[fd].events == events)
+		return;
+
+	struct epoll_event e;
+	memset(&e, 0, sizeof(e));
+	e.events = events;
+	e.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e) == -1)
+		errExit("epoll_ctl");
+	ev[fd].events = events;
+}
+
+// remove the file descriptor; call it before closing the socket
+void event_del(int fd) {
+	if (fd < 0 || fd >= ev_max || !ev[fd].handler)
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	ev[fd].handler = NULL;
+	ev[fd].arg = NULL;
+	ev[fd].events = 0;
+}
+
+// wake up the next event_wait() call no later than when (monotonic ms)
+void event_wakeup(double when) {
+	if (wakeup == 0 || when < wakeup)
+		wakeup = when;
+}
+
+// wait for events and run the handlers; sigmask is the signal mask set during the wait,
+// as in pselect(), or NULL
+// returns 1 when the one-second tick is due, 0 otherwise
+int event_wait(const sigset_t *sigmask) {
+	if (epfd == -1)
+		event_init();
+
+	double now = event_clock();
+	double next = (wakeup && wakeup < tick) ? wakeup : tick;
+	wakeup = 0;
+	int timeout = (next > now) ? (int) (next - now) + 1 : 0;
+
+	struct epoll_event e[EVENT_BATCH];
+	int n = epoll_pwait(epfd, e, EVENT_BATCH, timeout, sigmask);
+	if (n == -1) {
+		if (errno != EINTR)
+			errExit("epoll_pwait");
+		n = 0;
+	}
+
+	int i;
+	for (i = 0; i < n; i++) {
+		int fd = e[i].data.fd;
+		// the descriptor could be removed by one of the previous handlers
+		if (fd < ev_max && ev[fd].handler)
+			ev[fd].handler(fd, e[i].events, ev[fd].arg);
+	}
+
+	now = event_clock();
+	if (now < tick)
+		return 0;
+	tick += 1000;
+	if (tick <= now)	// we are falling behind
+		tick = now + 1000;
+	return 1;
+}
@@ -25,6 +25,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -33,6 +34,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
 
 #define errExit(msg)  \
 	do { char msgout[500]; \
@@ -78,22 +81,60 @@ static inline int check_addr_port(const char *str) {
 #define MONITOR_WAIT_TIMER 2	// wait for this number of seconds before restarting a failed resolver process
 #define CONSOLE_PRINTOUT_TIMER 5	// transfer stats from resolver to frontend
 #define SSL_REOPEN_TIMER 5	// try to reopen a failed SSL connection after this time
+#define SSL_IDLE_TIMER 300	// seconds, an SSL connection without queries for this long is closed
 #define OUT_OF_SLEEP 20	// detect computer going out of sleep/hibernation, reinitialize SSL connections
-#define CACHE_TTL_DEFAULT (40 * 60)	// default DNS cache ttl in seconds
+#define CACHE_TTL_DEFAULT (60 * 60)	// default DNS cache ttl ceiling in seconds
 #define CACHE_TTL_MIN (1 * 60)
-#define CACHE_TTL_MAX (60 * 60)
-#define CACHE_TTL_ERROR (10 * 60)	// cache ttl for errror mesage (such as NXDOMAIN) returned by the server
+#define CACHE_TTL_MAX (24 * 60 * 60)
+#define CACHE_MIN_TTL_DEFAULT 10	// default DNS cache ttl floor in seconds
+#define CACHE_MIN_TTL_MAX (10 * 60)
+#define CACHE_REPLY_MIN 512	// --cache-max-reply range, the default is MAXBUF
+#define CACHE_SIZE_DEFAULT 16	// default DNS cache size in MB, for each resolver process
+#define CACHE_SIZE_MAX 1024
+#define CACHE_TTL_ERROR (10 * 60)	// cache ttl for responses without a TTL, such as errors without a SOA record
+#define QUERY_MAX 1024	// maximum number of DoH queries in flight in a resolver process
+#define COALESCE_MAX 64	// identical queries waiting for the response of a DoH query in flight
 
 // number of resolver processes
 #define RESOLVERS_CNT_MIN 1	// number of resolver processes
 #define RESOLVERS_CNT_MAX 10
 #define RESOLVERS_CNT_DEFAULT 3
+#define TIMEOUT_CONNECT_DEFAULT 3000	// DoH connection setup timeout in ms, TCP and TLS handshake
+#define TIMEOUT_WRITE_DEFAULT 2000	// DoH write timeout in ms, no progress sending the requests
+#define TIMEOUT_READ_DEFAULT 2500	// DoH read timeout in ms, waiting for a response
+#define TIMEOUT_MIN 100
+#define TIMEOUT_MAX 20000	// well below RESOLVER_KEEPALIVE_SHUTDOWN
+#define RECONNECT_WAIT_DEFAULT 1000	// ms, a query waits this long for a connection before the fallback server
+#define SSL_HOLD_MAX 256	// queries waiting for a connection
+#define SSL_HOLD_RETRY 250	// ms, connection attempts while queries are waiting
+#define SCHED_ALPHA 0.2	// weight of a new sample in the server response time and error rate averages
+#define SCHED_PROBE 10000	// ms, a server without a sample for this long gets the next query
+#define SCHED_SLOW 4	// servers slower than this times the fastest one get only the probes
+#define SCHED_ERR_MAX 0.5	// servers with the error rate above this value get only the probes
+#define SCHED_LOAD 1.25	// hash scheduler: a server takes at most this times the average load
+#define SCHED_SAMPLES 32	// response times kept for the p95 estimate
+#define BREAKER_FAILURES 5	// failed queries in a row taking a server out of the pool
+#define BREAKER_WAIT 10000	// ms, time out of the pool before a background probe
+#define HEDGE_RATE_DEFAULT 5	// hedged requests, percent of the DoH queries
+#define HEDGE_RATE_MAX 50
+#define HEDGE_BURST 10	// hedged requests allowed in a burst
+#define BENCH_PARALLEL 16	// --benchmark: servers tested at the same time
+#define BENCH_ROUNDS 5	// --benchmark: queries for each domain
+#define BENCH_DOMAINS_MAX 100
+#define BENCH_TIMEOUT 60	// --benchmark: seconds allowed for testing a server
+#define PROBE_POOL 4	// startup: the fastest servers going in the resolver pool
+#define PROBE_CANDIDATES 8	// startup: servers probed, picked at random in the current zone
+#define PROBE_QUERIES 3	// startup: queries sent to each candidate server
+#define PROBE_PARALLEL 32	// startup: servers probed at the same time
+#define PROBE_TIMEOUT 5	// startup: seconds allowed for probing a server
+#define RANKING_TTL (24 * 3600)	// seconds, the server ranking is probed again after this time
 #define UNIX_ADDRESS "fdns"	// internal UNIX socket address for communication between frontend and resolvers
 #define DEFAULT_PROXY_ADDR "127.1.1.1"
 
 // filesystem paths
 #define PATH_FDNS (PREFIX "/bin/fdns")
 #define PATH_RUN_FDNS "/run/fdns"
+#define PATH_RUN_RANKING (PATH_RUN_FDNS "/servers-rank")
 #define PATH_ETC_TRACKERS_LIST (SYSCONFDIR "/trackers")
 #define PATH_ETC_FP_TRACKERS_LIST (SYSCONFDIR "/fp-trackers")
 #define PATH_ETC_ADBLOCKER_LIST (SYSCONFDIR "/adblocker")
@@ -107,6 +148,7 @@ static inline int check_addr_port(const char *str) {
 
 
 #define MAXBUF 2048
+#define CACHE_NAME_LEN 100 // requests for domain names bigger than this value are not cached
 typedef struct stats_t {
 	int changed;
 
@@ -116,12 +158,25 @@ typedef struct stats_t {
 	unsigned drop;
 	unsigned cached;
 	unsigned fwd;
+	unsigned hedge;	// DoH queries sent to a second server
+	unsigned coalesced;	// queries answered by an identical DoH query already in flight
+	unsigned cache_miss;
+	unsigned cache_admit;	// entries moved from the cache window in the main area
+	unsigned cache_reject;	// entries dropped at the end of the window, not popular enough
+	unsigned cache_evict;	// entries dropped to stay under --cache-size
 
 	// average time
 	double ssl_pkts_timetrace;
 	unsigned ssl_pkts_cnt;
 } Stats;
 
+// circuit breaker for a server in the pool
+typedef enum {
+	BREAKER_CLOSED = 0,	// the server takes queries
+	BREAKER_OPEN,	// too many failures in a row, the server is skipped
+	BREAKER_HALF_OPEN	// waiting for the result of a background probe
+} BreakerState;
+
 typedef struct dnsserver_t {
 	struct dnsserver_t *next;// linked list
 	int  active;		// flag for random purposes
@@ -133,11 +188,60 @@ typedef struct dnsserver_t {
 	char *tags;	// description
 	char *address;	// IP address
 	char *host;		// POST request first line
-	char *request;	// full POST request
+	char *path;		// URL path
+	char *request;	// POST request header, up to the content-length value
+	int request_len;
 	int sni;		// 1 or 0
+	int h2_streams;	// HTTP/2 concurrent streams limit, 0 disables HTTP/2
+	int pipelining;	// HTTP/1.1 pipelining: 1 or 0
+	int dot;	// DNS over TLS (RFC 7858) instead of DoH: 1 or 0
 	int ssl_keepalive;	// keepalive in seconds
+	int connect_timeout;	// timeouts in ms, 0 for the global value
+	int write_timeout;
+	int read_timeout;
+
+	// scheduler data, kept separately by each resolver process for the servers in the pool
+	double rtt;	// moving average of the response time in ms, 0 if not measured yet
+	double err;	// moving average of the error rate, 0 to 1
+	double probe;	// time of the last sample or probe query, in ms
+	int pending;	// queries in the connection queue or waiting for the response
+	float sample[SCHED_SAMPLES];	// last response times in ms
+	int sample_cnt;
+	double p95;	// 95th percentile of the response time, 0 if not enough samples
+	int failures;	// failed queries in a row
+	BreakerState breaker;	// circuit breaker
+	double breaker_time;	// time of the last breaker state change, in ms
 } DnsServer;
 
+// upstream server selection, --scheduler
+typedef enum {
+	SCHED_LATENCY = 0,	// weighted by the response time and error rate
+	SCHED_RANDOM,
+	SCHED_HASH	// by domain name, rendezvous hashing with bounded load
+} SchedType;
+
+// DoH query in flight
+typedef struct dnsquery_t {
+	struct dnsquery_t *next;	// linked list - SSL connection queue
+	struct sockaddr_in addr;	// client address
+	int keepalive;	// internal keepalive query, there is no client
+	double start;	// time the query was received, in ms
+	double deadline;	// the response is expected by this time, in ms
+	int retry;	// number of times the query was moved to a different server
+	double sent;	// time the query was added to the current connection, in ms
+	int abandoned;	// HTTP/1.1: timed out, the response is discarded when it comes in
+	int hedged;	// the query was considered for a hedged request
+	int lost;	// the hedged copy answered first, the response is discarded but the latency is recorded
+	struct dnsquery_t *hedge;	// the same query in flight on a different server, the first response wins
+	struct inflight_t *inflight;	// identical queries waiting for the response, owned by resolver.c
+	char cname[CACHE_NAME_LEN + 1];	// cache name, empty if the response is not cached
+	int cname_type;	// 0 - ipv4, 1 - ipv6
+	int stream;	// HTTP/2 stream index
+	int len;	// query length
+	uint8_t query[MAXBUF];
+	uint8_t reply[MAXBUF];	// HTTP/2 response data
+} DnsQuery;
+
 static inline void ansi_topleft(void) {
 	char str[] = {0x1b, '[', '1', ';',  '1', 'H', '\0'};
 	printf("%s", str);
@@ -180,14 +284,23 @@ extern char *arg_forwarder;
 extern int arg_test_hosts;
 extern char *arg_zone;
 extern int arg_cache_ttl;
+extern int arg_cache_min_ttl;
+extern int arg_cache_max_reply;
+extern int arg_cache_size;
+extern int arg_connect_timeout;
+extern int arg_write_timeout;
+extern int arg_read_timeout;
+extern int arg_reconnect_wait;
 extern int arg_allow_local_doh;
+extern int arg_ktls;
+extern SchedType arg_scheduler;
+extern int arg_hedge_rate;
 extern Stats stats;
 
 // dnsdb.c
 void dnsdb_init(void);
 void dnsdb_store(uint8_t *buf, struct sockaddr_in *addr);
 struct sockaddr_in *dnsdb_retrieve(uint8_t *buf);
-void dnsdb_timeout(void);
 
 // ssl.c
 typedef enum {
@@ -197,15 +310,23 @@ typedef enum {
 extern SSLState ssl_state;
 
 void ssl_init(void);
+void ssl_session_load(void);
+void ssl_open_server(DnsServer *srv);
+double ssl_test_open(DnsServer *srv);
+double ssl_test_query(DnsServer *srv, const char *domain);
 void ssl_open(void);
 void ssl_close(void);
-int ssl_dns(uint8_t *msg, int cnt);
-int ssl_dns_pool(const char* domain, uint8_t *msg, int cnt);
+int ssl_closed(void);
+void ssl_dns_pool(const char* domain, DnsQuery *q);
+void ssl_send_queued(void);
 void ssl_keepalive(void);
-int ssl_status_check(void);
+void ssl_keepalive_timer(void);
+void ssl_timeout(void);
 
 // frontend.c
 extern int encrypted[RESOLVERS_CNT_MAX];
+extern int pool_open[RESOLVERS_CNT_MAX];
+extern int pool_len[RESOLVERS_CNT_MAX];
 void frontend(void);
 
 // security.c
@@ -270,20 +391,46 @@ void server_load(void);
 void server_list(const char *tag);
 DnsServer *server_get(void);
 DnsServer *server_pool_get(const char* domain);
-DnsServer *server_pool_get_2(const char* domain);
+int server_pool_len(void);
+DnsServer *server_pool_entry(int index);
+void server_pool_result(DnsServer *srv, double rtt);
+int server_pool_probe_due(DnsServer *srv);
+int server_pool_sample_due(DnsServer *srv);
 // return 0 if ok, 1 if failed
 void server_test_tag(const char *tag);
+void server_benchmark(const char *tag, const char *domains);
 
 // cache.c
-#define CACHE_NAME_LEN 100 // requests for domain names bigger than this value are not cached
 void cache_set_name(const char *name, int ipv6);
+const char *cache_get_name(int *ipv6);
 void cache_set_reply(uint8_t *reply, ssize_t len, int ttl);
 uint8_t *cache_check(uint16_t id, const char *name, ssize_t *lenptr, int ipv6);
-void cache_timeout(void);
 void cache_init(void);
 
 // resolver.c
 void resolver(void);
+void resolver_reply(DnsQuery *q, uint8_t *reply, int len);
+
+// event.c
+typedef void (*EventHandler)(int fd, uint32_t events, void *arg);
+double event_clock(void);
+void event_add(int fd, uint32_t events, EventHandler handler, void *arg);
+void event_mod(int fd, uint32_t events);
+void event_del(int fd);
+void event_wakeup(double when);
+int event_wait(const sigset_t *sigmask);
+
+// wheel.c
+typedef struct wheel_timer_t {
+	struct wheel_timer_t *next;
+	struct wheel_timer_t **pprev;	// NULL if the timer is not running
+	uint32_t expire;	// wheel tick
+	void (*handler)(struct wheel_timer_t *t);
+} WheelTimer;	// set it to zero before the first use
+typedef void (*WheelHandler)(WheelTimer *t);
+void wheel_add(WheelTimer *t, unsigned seconds, WheelHandler handler);
+void wheel_del(WheelTimer *t);
+void wheel_tick(void);
 
 // net.c
 void net_check_proxy_addr(const char *str);
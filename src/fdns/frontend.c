@@ -39,6 +39,8 @@ int __clone2(int (*fn)(void *),
 #endif
 
 int encrypted[RESOLVERS_CNT_MAX];
+int pool_open[RESOLVERS_CNT_MAX];	// open connections in the resolver pool
+int pool_len[RESOLVERS_CNT_MAX];
 
 typedef struct resolver_t {
 	pid_t pid;
@@ -123,6 +125,12 @@ static int sandbox(void *sandbox_arg) {
 		a[last++] = "--allow-all-queries";
 	if (arg_allow_local_doh)
 		a[last++] = "--allow-local-doh";
+	if (arg_ktls)
+		a[last++] = "--ktls";
+	if (arg_scheduler == SCHED_RANDOM)
+		a[last++] = "--scheduler=random";
+	else if (arg_scheduler == SCHED_HASH)
+		a[last++] = "--scheduler=hash";
 
 	if (arg_cache_ttl != CACHE_TTL_DEFAULT) {
 		char *cmd;
@@ -130,6 +138,54 @@ static int sandbox(void *sandbox_arg) {
 			errExit("asprintf");
 		a[last++] = cmd;
 	}
+	if (arg_cache_max_reply != MAXBUF) {
+		char *cmd;
+		if (asprintf(&cmd, "--cache-max-reply=%d", arg_cache_max_reply) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
+	if (arg_cache_min_ttl != CACHE_MIN_TTL_DEFAULT) {
+		char *cmd;
+		if (asprintf(&cmd, "--cache-min-ttl=%d", arg_cache_min_ttl) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
+	if (arg_cache_size != CACHE_SIZE_DEFAULT) {
+		char *cmd;
+		if (asprintf(&cmd, "--cache-size=%d", arg_cache_size) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
+	if (arg_connect_timeout != TIMEOUT_CONNECT_DEFAULT) {
+		char *cmd;
+		if (asprintf(&cmd, "--connect-timeout=%d", arg_connect_timeout) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
+	if (arg_write_timeout != TIMEOUT_WRITE_DEFAULT) {
+		char *cmd;
+		if (asprintf(&cmd, "--write-timeout=%d", arg_write_timeout) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
+	if (arg_hedge_rate != HEDGE_RATE_DEFAULT) {
+		char *cmd;
+		if (asprintf(&cmd, "--hedge-rate=%d", arg_hedge_rate) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
+	if (arg_reconnect_wait != RECONNECT_WAIT_DEFAULT) {
+		char *cmd;
+		if (asprintf(&cmd, "--reconnect-wait=%d", arg_reconnect_wait) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
+	if (arg_read_timeout != TIMEOUT_READ_DEFAULT) {
+		char *cmd;
+		if (asprintf(&cmd, "--read-timeout=%d", arg_read_timeout) == -1)
+			errExit("asprintf");
+		a[last++] = cmd;
+	}
 
 
 	Forwarder *f = fwd;
@@ -149,15 +205,114 @@ static int sandbox(void *sandbox_arg) {
 	exit(1);
 }
 
+// log messages and keepalives coming from the resolver processes
+static void resolver_rx(int fd, uint32_t events, void *arg) {
+	(void) events;
+	int i = (int) (intptr_t) arg;
+	LogMsg msg;
+	ssize_t len = read(fd, &msg, sizeof(LogMsg));
+	if (len == -1) {
+		// a signal came in, or the message was already read; epoll calls us again if needed
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		errExit("read");
+	}
+
+	// check length
+	if (len != msg.h.len) {
+		logprintf("Error: log message with an invalid length\n");
+		return;
+	}
+
+	// parse the incoming message
+	msg.buf[len - sizeof(LogMsgHeader)] = '\0';
+
+	// parse incoming message
+	if (strncmp(msg.buf, "Stats: ", 7) == 0) {
+		Stats s;
+		sscanf(msg.buf, "Stats: rx %u, dropped %u, fallback %u, cached %u, fwd %u, hedged %u, coalesced %u, "
+		       "miss %u, admitted %u, rejected %u, evicted %u, %lf",
+		       &s.rx,
+		       &s.drop,
+		       &s.fallback,
+		       &s.cached,
+		       &s.fwd,
+		       &s.hedge,
+		       &s.coalesced,
+		       &s.cache_miss,
+		       &s.cache_admit,
+		       &s.cache_reject,
+		       &s.cache_evict,
+		       &s.ssl_pkts_timetrace);
+
+		// calculate global stats
+		stats.rx += s.rx;
+		stats.drop += s.drop;
+		stats.fallback += s.fallback;
+		stats.cached += s.cached;
+		stats.fwd += s.fwd;
+		stats.hedge += s.hedge;
+		stats.coalesced += s.coalesced;
+		stats.cache_miss += s.cache_miss;
+		stats.cache_admit += s.cache_admit;
+		stats.cache_reject += s.cache_reject;
+		stats.cache_evict += s.cache_evict;
+		if (s.ssl_pkts_timetrace) {
+			stats.ssl_pkts_timetrace += s.ssl_pkts_timetrace;
+			stats.ssl_pkts_timetrace /= 2;
+		}
+
+		shmem_store_stats();
+	}
+	else if (strncmp(msg.buf, "Request: ", 9) == 0) {
+		printf("%s", msg.buf + 9);
+		shmem_store_log(msg.buf + 9);
+	}
+	else if (strncmp(msg.buf, "resolver keepalive", 16) == 0)
+		w[i].keepalive = RESOLVER_KEEPALIVE_SHUTDOWN;
+	else {
+		if (strncmp(msg.buf, "SSL connection opened", 21) == 0) {
+			encrypted[i] = 1;
+			shmem_store_stats();
+		}
+		else if (strncmp(msg.buf, "SSL connection closed", 21) == 0) {
+			encrypted[i] = 0;;
+			shmem_store_stats();
+		}
+		else if (strncmp(msg.buf, "SSL pool: ", 10) == 0) {
+			if (sscanf(msg.buf, "SSL pool: %d/%d", &pool_open[i], &pool_len[i]) != 2)
+				pool_open[i] = pool_len[i] = 0;
+			shmem_store_stats();
+		}
+
+		char *tmp;
+		if (asprintf(&tmp, "(%d) %s", i, msg.buf) == -1)
+			errExit("asprintf");
+		logprintf("%s", tmp);
+		shmem_store_log(tmp);
+		free(tmp);
+	}
+
+	// respond with a keepalive; if the resolver is gone it stops sending messages,
+	// and it is restarted when its keepalive counter runs out
+	if (write(fd, "keepalive", 10) == -1 && errno != EINTR && errno != EAGAIN)
+		logprintf("Warning: cannot send keepalive to resolver %d: %s\n", i, strerror(errno));
+
+	fflush(0);
+}
+
 static void start_sandbox(int id) {
 	assert(id < RESOLVERS_CNT_MAX);
 	encrypted[id] = 0;
+	pool_open[id] = 0;
+	pool_len[id] = 0;
 
 	if (w[id].fd[0] == 0) {
 		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, w[id].fd) < 0)
 			errExit("socketpair");
 		if (arg_debug)
 			printf("resolverid %d, sockpair %d, %d\n", id, w[id].fd[0], w[id].fd[1]);
+		event_add(w[id].fd[0], EPOLLIN, resolver_rx, (void *) (intptr_t) id);
 	}
 
 	int flags = CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWIPC | SIGCHLD;
@@ -235,7 +390,7 @@ void frontend(void) {
 		printf("Starting sandbox for arg_id=%d\n", i);
 		start_sandbox(i);
 	}
-	// handle SIGCHLD in pselect loop
+	// handle SIGCHLD in the event loop
 	sigset_t sigmask, empty_mask;
 	struct sigaction sa;
 
@@ -252,32 +407,30 @@ void frontend(void) {
 
 	sigemptyset(&empty_mask);
 
-	struct timespec t = { 1, 0};	// one second timeout
 	time_t timestamp = time(NULL);	// detect the computer going to sleep in order to reinitialize SSL connections
 	int send_keepalive_cnt = 0;
 	while (1) {
-		fd_set rset;
-		FD_ZERO(&rset);
-		int fdmax = 0;
-		for (i = 0; i < arg_resolvers; i++) {
-			FD_SET(w[i].fd[0], &rset);
-			fdmax = (fdmax < w[i].fd[0]) ? w[i].fd[0] : fdmax;
-		}
-		fdmax++;
-
-		int rv = pselect(fdmax, &rset, NULL, NULL, &t, &empty_mask);
-		if (rv == -1) {
-			if (errno == EINTR) {
-				// select() man page reads:
-				// "... the sets and  timeout become undefined, so
-				// do not rely on their contents after an error. "
-				t.tv_sec = 1;
-				t.tv_nsec = 0;
-				continue;
+		// SIGCHLD is delivered only while waiting for events
+		int tick = event_wait(&empty_mask);
+
+		if (got_SIGCHLD) { // indicates a child process died
+			pid_t pid = -1;;
+			int status;
+			got_SIGCHLD = 0;
+
+			// find a dead resolver
+			int i;
+			for (i = 0; i < arg_resolvers; i++) {
+				pid = waitpid(w[i].pid, &status, WNOHANG);
+				if (pid == w[i].pid) {
+					logprintf("Error: resolver %d (pid %u) terminated, restarting it...\n", i, pid);
+					kill(pid, SIGTERM); // just in case
+					start_sandbox(i);
+				}
 			}
-			printf("***\n");
 		}
-		else if (rv == 0) {
+
+		if (tick) {
 			time_t ts = time(NULL);
 			int i;
 
@@ -314,99 +467,8 @@ void frontend(void) {
 				}
 			}
 
-			t.tv_sec = 1;
-			t.tv_nsec = 0;
 			timestamp = time(NULL);
 		}
-		else if (got_SIGCHLD) { // indicates a child process died
-			pid_t pid = -1;;
-			int status;
-			got_SIGCHLD = 0;
-
-			// find a dead resolver
-			int i;
-			for (i = 0; i < arg_resolvers; i++) {
-				pid = waitpid(w[i].pid, &status, WNOHANG);
-				if (pid == w[i].pid) {
-					logprintf("Error: resolver %d (pid %u) terminated, restarting it...\n", i, pid);
-					kill(pid, SIGTERM); // just in case
-					start_sandbox(i);
-				}
-			}
-		}
-		else {
-			for (i = 0; i < arg_resolvers; i++) {
-				if (FD_ISSET(w[i].fd[0], &rset)) {
-					LogMsg msg;
-					ssize_t len = read(w[i].fd[0], &msg, sizeof(LogMsg));
-					if (len == -1) // todo: parse EINTR
-						errExit("read");
-
-					// check length
-					if (len != msg.h.len) {
-						logprintf("Error: log message with an invalid length\n");
-						continue;
-					}
-
-					// parse the incoming message
-					msg.buf[len - sizeof(LogMsgHeader)] = '\0';
-
-					// parse incoming message
-					if (strncmp(msg.buf, "Stats: ", 7) == 0) {
-						Stats s;
-						sscanf(msg.buf, "Stats: rx %u, dropped %u, fallback %u, cached %u, fwd %u, %lf",
-						       &s.rx,
-						       &s.drop,
-						       &s.fallback,
-						       &s.cached,
-						       &s.fwd,
-						       &s.ssl_pkts_timetrace);
-
-						// calculate global stats
-						stats.rx += s.rx;
-						stats.drop += s.drop;
-						stats.fallback += s.fallback;
-						stats.cached += s.cached;
-						stats.fwd += s.fwd;
-						if (s.ssl_pkts_timetrace) {
-							stats.ssl_pkts_timetrace += s.ssl_pkts_timetrace;
-							stats.ssl_pkts_timetrace /= 2;
-						}
-
-						shmem_store_stats();
-					}
-					else if (strncmp(msg.buf, "Request: ", 9) == 0) {
-						printf("%s", msg.buf + 9);
-						shmem_store_log(msg.buf + 9);
-					}
-					else if (strncmp(msg.buf, "resolver keepalive", 16) == 0)
-						w[i].keepalive = RESOLVER_KEEPALIVE_SHUTDOWN;
-					else {
-						if (strncmp(msg.buf, "SSL connection opened", 21) == 0) {
-							encrypted[i] = 1;
-							shmem_store_stats();
-						}
-						else if (strncmp(msg.buf, "SSL connection closed", 21) == 0) {
-							encrypted[i] = 0;;
-							shmem_store_stats();
-						}
-
-						char *tmp;
-						if (asprintf(&tmp, "(%d) %s", i, msg.buf) == -1)
-							errExit("asprintf");
-						logprintf("%s", tmp);
-						shmem_store_log(tmp);
-						free(tmp);
-					}
-
-					// respond with a keepalive
-					int rv = write(w[i].fd[0], "keepalive", 10);
-					(void) rv; // todo: error recovery
-
-					fflush(0);
-				}
-			}
-		}
 		fflush(0);
 	}
 }
@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2019-2020 FDNS Authors
+ *
+ * This file is part of fdns project
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "fdns.h"
+#include "h1.h"
+
+void h1_init(H1Parser *p, int max) {
+	memset(p, 0, sizeof(H1Parser));
+	p->clen = -1;
+	p->max = max;
+}
+
+// find the end of the line starting at p->pos; returns the line length without CRLF, -1 if the
+// line is not complete
+static int line_end(H1Parser *p, const uint8_t *buf, int len) {
+	const uint8_t *ptr = memchr(buf + p->pos, '\n', len - p->pos);
+	if (!ptr)
+		return -1;
+	int n = ptr - (buf + p->pos);
+	if (n > 0 && ptr[-1] == '\r')
+		n--;
+	return n;
+}
+
+// skip the current line, n is the value returned by line_end()
+static inline void line_next(H1Parser *p, const uint8_t *buf, int n) {
+	p->pos += n;
+	if (buf[p->pos] == '\r')
+		p->pos++;
+	p->pos++;	// '\n'
+}
+
+// case-insensitive header name match; returns a pointer to the value, NULL if no match
+static const uint8_t *header_match(const uint8_t *line, int n, const char *name) {
+	int len = strlen(name);
+	if (n <= len || strncasecmp((const char *) line, name, len) != 0 || line[len] != ':')
+		return NULL;
+	line += len + 1;
+	while (*line == ' ' || *line == '\t')
+		line++;
+	return line;
+}
+
+// decimal or hex number; returns -1 if there are no digits or the number is too large
+static int number(const uint8_t *ptr, const uint8_t *end, int base) {
+	int v = 0;
+	int digits = 0;
+	for (; ptr < end; ptr++, digits++) {
+		int d;
+		if (*ptr >= '0' && *ptr <= '9')
+			d = *ptr - '0';
+		else if (base == 16 && *ptr >= 'a' && *ptr <= 'f')
+			d = *ptr - 'a' + 10;
+		else if (base == 16 && *ptr >= 'A' && *ptr <= 'F')
+			d = *ptr - 'A' + 10;
+		else
+			break;
+		v = v * base + d;
+		if (v > MAXBUF * 16)
+			return -1;
+	}
+	return (digits) ? v : -1;
+}
+
+static int header_line(H1Parser *p, const uint8_t *line, int n) {
+	const uint8_t *end = line + n;
+	const uint8_t *val;
+	if ((val = header_match(line, n, "content-length")) != NULL) {
+		p->clen = number(val, end, 10);
+		if (p->clen < 0)
+			return -1;
+	}
+	else if ((val = header_match(line, n, "transfer-encoding")) != NULL) {
+		if (end - val >= 7 && strncasecmp((const char *) end - 7, "chunked", 7) == 0)
+			p->chunked = 1;
+	}
+	return 0;
+}
+
+// parse the data received so far; buf holds the full response from the start, len bytes
+// returns 1 if the response is complete, 0 if we need more data, -1 if error
+// On completion p->pos is the length of the response in the buffer, and the body is
+// found at buf + p->body, p->len bytes.
+int h1_parse(H1Parser *p, uint8_t *buf, int len) {
+	while (p->pos < len) {
+		int n;
+		switch (p->state) {
+		case H1_STATUS:
+			if ((n = line_end(p, buf, len)) == -1)
+				return 0;
+			// HTTP/1.1 200 OK
+			if (n < 12 || memcmp(buf + p->pos, "HTTP/1.", 7) != 0 || buf[p->pos + 8] != ' ')
+				return -1;
+			p->status = number(buf + p->pos + 9, buf + p->pos + 12, 10);
+			if (p->status < 100)
+				return -1;
+			line_next(p, buf, n);
+			p->state = H1_HEADER;
+			break;
+
+		case H1_HEADER:
+			if ((n = line_end(p, buf, len)) == -1)
+				return 0;
+			if (n) {
+				if (header_line(p, buf + p->pos, n))
+					return -1;
+				line_next(p, buf, n);
+				break;
+			}
+
+			// empty line, the body starts here
+			line_next(p, buf, n);
+			p->hlen = p->pos;
+			p->body = p->pos;
+			if (p->chunked)
+				p->state = H1_CHUNK_SIZE;
+			else if (p->clen >= 0) {
+				if (p->clen > p->max)
+					return -1;
+				p->remain = p->clen;
+				p->state = H1_BODY;
+			}
+			else	// we don't support responses delimited by closing the connection
+				return -1;
+			break;
+
+		case H1_BODY:
+			n = (len - p->pos < p->remain) ? len - p->pos : p->remain;
+			p->pos += n;
+			p->len += n;
+			p->remain -= n;
+			break;
+
+		case H1_CHUNK_SIZE:
+			if ((n = line_end(p, buf, len)) == -1)
+				return 0;
+			p->remain = number(buf + p->pos, buf + p->pos + n, 16);	// chunk extensions are ignored
+			if (p->remain < 0 || p->len + p->remain > p->max)
+				return -1;
+			line_next(p, buf, n);
+			p->state = (p->remain) ? H1_CHUNK_DATA : H1_TRAILER;
+			break;
+
+		case H1_CHUNK_DATA:
+			// move the chunk data right after the previous chunk
+			n = (len - p->pos < p->remain) ? len - p->pos : p->remain;
+			if (p->body + p->len != p->pos)
+				memmove(buf + p->body + p->len, buf + p->pos, n);
+			p->pos += n;
+			p->len += n;
+			p->remain -= n;
+			if (p->remain == 0)
+				p->state = H1_CHUNK_END;
+			break;
+
+		case H1_CHUNK_END:
+			if ((n = line_end(p, buf, len)) == -1)
+				return 0;
+			if (n)
+				return -1;
+			line_next(p, buf, n);
+			p->state = H1_CHUNK_SIZE;
+			break;
+
+		case H1_TRAILER:
+			if ((n = line_end(p, buf, len)) == -1)
+				return 0;
+			line_next(p, buf, n);
+			if (n == 0)
+				p->state = H1_DONE;
+			break;
+
+		case H1_DONE:
+			return 1;
+		}
+
+		if (p->state == H1_BODY && p->remain == 0)
+			p->state = H1_DONE;
+	}
+
+	// a response with no body is complete after the header
+	if (p->state == H1_BODY && p->remain == 0)
+		p->state = H1_DONE;
+	return (p->state == H1_DONE) ? 1 : 0;
+}
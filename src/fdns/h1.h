@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2019-2020 FDNS Authors
+ *
+ * This file is part of fdns project
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef H1_H
+#define H1_H
+
+#include <stdint.h>
+
+// incremental HTTP/1.1 response parser (RFC 7230)
+// The parser runs over the receive buffer as the data comes in, and it never copies
+// the body out: on completion the body is found in the buffer at offset "body".
+// Chunked bodies are joined in place.
+
+typedef enum {
+	H1_STATUS = 0,	// waiting for the status line
+	H1_HEADER,	// header lines
+	H1_BODY,	// Content-Length body
+	H1_CHUNK_SIZE,	// chunk size line
+	H1_CHUNK_DATA,	// chunk data
+	H1_CHUNK_END,	// CRLF after the chunk data
+	H1_TRAILER,	// trailer lines after the last chunk
+	H1_DONE
+} H1State;
+
+typedef struct h1_parser_t {
+	H1State state;
+	int pos;	// bytes parsed so far
+	int status;	// HTTP status code
+	int chunked;	// Transfer-Encoding: chunked
+	int clen;	// Content-Length, -1 if not present
+	int remain;	// bytes left in the body or in the current chunk
+	int hlen;	// header length, including the empty line
+	int body;	// body offset in the buffer
+	int len;	// body length
+	int max;	// maximum body length
+} H1Parser;
+
+void h1_init(H1Parser *p, int max);
+int h1_parse(H1Parser *p, uint8_t *buf, int len);
+
+#endif
@@ -0,0 +1,640 @@
+/*
+ * Copyright (C) 2019-2020 FDNS Authors
+ *
+ * This file is part of fdns project
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "fdns.h"
+#include "h2.h"
+#include <ctype.h>
+
+// frame types
+#define H2_DATA 0
+#define H2_HEADERS 1
+#define H2_PRIORITY 2
+#define H2_RST_STREAM 3
+#define H2_SETTINGS 4
+#define H2_PUSH_PROMISE 5
+#define H2_PING 6
+#define H2_GOAWAY 7
+#define H2_WINDOW_UPDATE 8
+#define H2_CONTINUATION 9
+
+// frame flags
+#define H2_FLAG_ACK 0x01
+#define H2_FLAG_END_STREAM 0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED 0x08
+#define H2_FLAG_PRIORITY 0x20
+
+// settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE 1
+#define H2_SETTINGS_ENABLE_PUSH 2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 4
+#define H2_SETTINGS_MAX_FRAME_SIZE 5
+
+// error codes
+#define H2_REFUSED_STREAM 7
+#define H2_CANCEL 8
+
+#define H2_WINDOW_DEFAULT 65535
+#define H2_TABLE_SIZE_DEFAULT 4096
+#define H2_RECV_WINDOW (1024 * 1024)	// connection receive window we advertise
+#define H2_WINDOW_UPDATE_THRESHOLD (H2_RECV_WINDOW / 2)
+#define H2_STREAM_ID_MAX 0x7fffffff
+
+static const uint8_t preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const char *mime = "application/dns-message";
+
+static inline void put32(uint8_t *p, uint32_t v) {
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+// start a frame in the output buffer; returns a pointer to the frame payload,
+// NULL if the buffer is full
+static uint8_t *frame_start(H2Conn *h, uint8_t type, uint8_t flags, uint32_t id, uint32_t len) {
+	if (h->outlen + H2_FRAME_HEADER + (int) len > H2_OUTBUF)
+		return NULL;
+
+	uint8_t *p = h->out + h->outlen;
+	p[0] = (len >> 16) & 0xff;
+	p[1] = (len >> 8) & 0xff;
+	p[2] = len & 0xff;
+	p[3] = type;
+	p[4] = flags;
+	put32(p + 5, id & H2_STREAM_ID_MAX);
+	h->outlen += H2_FRAME_HEADER + len;
+	return p + H2_FRAME_HEADER;
+}
+
+// returns -1 if the output buffer is full
+static int send_window_update(H2Conn *h, uint32_t id, uint32_t increment) {
+	uint8_t *p = frame_start(h, H2_WINDOW_UPDATE, 0, id, 4);
+	if (!p)
+		return -1;
+	put32(p, increment);
+	return 0;
+}
+
+//**************************************************************************
+// HPACK
+//**************************************************************************
+// static table indexes (RFC 7541 Appendix A)
+#define HPACK_AUTHORITY 1
+#define HPACK_METHOD_POST 3
+#define HPACK_PATH 4
+#define HPACK_SCHEME_HTTPS 7
+#define HPACK_STATUS_200 8
+#define HPACK_STATUS_500 14	// :status 200 to 500 are entries 8 to 14
+#define HPACK_ACCEPT 19
+#define HPACK_CONTENT_LENGTH 28
+#define HPACK_CONTENT_TYPE 31
+#define HPACK_DYNAMIC 62	// first dynamic table index
+
+// integer representation with an N-bit prefix; returns the number of bytes
+static int hpack_int(uint8_t *p, int nbits, uint8_t first, uint32_t value) {
+	uint32_t max = (1 << nbits) - 1;
+	if (value < max) {
+		*p = first | value;
+		return 1;
+	}
+
+	int i = 0;
+	p[i++] = first | max;
+	value -= max;
+	while (value >= 128) {
+		p[i++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	p[i++] = value;
+	return i;
+}
+
+// string literal, no Huffman encoding
+static int hpack_str(uint8_t *p, const char *str) {
+	int len = strlen(str);
+	int i = hpack_int(p, 7, 0, len);
+	memcpy(p + i, str, len);
+	return i + len;
+}
+
+// literal header field with an indexed name; incremental indexing or no indexing
+static int hpack_literal(uint8_t *p, int name_index, const char *value, int indexing) {
+	int i;
+	if (indexing)
+		i = hpack_int(p, 6, 0x40, name_index);
+	else
+		i = hpack_int(p, 4, 0, name_index);
+	return i + hpack_str(p + i, value);
+}
+
+// dynamic table entry size (RFC 7541 section 4.1)
+static inline uint32_t entry_size(const char *name, const char *value) {
+	return strlen(name) + strlen(value) + 32;
+}
+
+// encode the request header block; returns the number of bytes
+//
+// The first request on the connection stores :path, :authority, accept and content-type in the
+// server dynamic table; all the following requests refer to them using a single byte each.
+// The table is filled in this order, the last entry inserted gets the lowest index.
+static int hpack_request(H2Conn *h, uint8_t *p, const char *host, const char *path, int len) {
+	int i = 0;
+	uint32_t needed = entry_size(":path", path) + entry_size(":authority", host) +
+		entry_size("accept", mime) + entry_size("content-type", mime);
+
+	if (h->table_update) {
+		uint32_t size = (h->table_size < H2_TABLE_SIZE_DEFAULT) ? h->table_size : H2_TABLE_SIZE_DEFAULT;
+		i += hpack_int(p + i, 5, 0x20, size);
+		h->table_update = 0;
+	}
+
+	p[i++] = 0x80 | HPACK_METHOD_POST;
+	p[i++] = 0x80 | HPACK_SCHEME_HTTPS;
+	if (h->indexed) {
+		p[i++] = 0x80 | (HPACK_DYNAMIC + 3);	// :path
+		p[i++] = 0x80 | (HPACK_DYNAMIC + 2);	// :authority
+		p[i++] = 0x80 | (HPACK_DYNAMIC + 1);	// accept
+		p[i++] = 0x80 | HPACK_DYNAMIC;	// content-type
+	}
+	else {
+		int indexing = (needed <= h->table_size);
+		i += hpack_literal(p + i, HPACK_PATH, path, indexing);
+		i += hpack_literal(p + i, HPACK_AUTHORITY, host, indexing);
+		i += hpack_literal(p + i, HPACK_ACCEPT, mime, indexing);
+		i += hpack_literal(p + i, HPACK_CONTENT_TYPE, mime, indexing);
+		h->indexed = indexing;
+	}
+
+	char clen[16];
+	snprintf(clen, sizeof(clen), "%d", len);
+	i += hpack_literal(p + i, HPACK_CONTENT_LENGTH, clen, 0);
+	return i;
+}
+
+// Huffman-encoded 3-digit status code; returns 0 if not valid
+// The digits are the only symbols with 5-bit ('0' to '2') and 6-bit ('3' to '9') codes
+// starting with 0 (RFC 7541 Appendix B).
+static int hpack_huffman_status(const uint8_t *p, int len) {
+	uint32_t bits = 0;
+	int nbits = 0;
+	int status = 0;
+	int digits = 0;
+	int i = 0;
+	while (digits < 3) {
+		if (nbits < 6) {
+			if (i >= len)
+				return 0;
+			bits = (bits << 8) | p[i++];
+			nbits += 8;
+		}
+		uint32_t code = (bits >> (nbits - 5)) & 0x1f;
+		if (code <= 2) {
+			status = status * 10 + code;
+			nbits -= 5;
+		}
+		else {
+			code = (bits >> (nbits - 6)) & 0x3f;
+			if (code < 0x19 || code > 0x1f)
+				return 0;
+			status = status * 10 + code - 0x19 + 3;
+			nbits -= 6;
+		}
+		digits++;
+	}
+	return status;
+}
+
+// extract :status from the beginning of a response header block; returns 0 if not found
+// Only the pseudo-header is decoded; it always comes first in the block. Our SETTINGS
+// disable the dynamic table, the status is indexed in the static table or sent as a literal.
+static int hpack_status(const uint8_t *p, int len) {
+	int i = 0;
+
+	// skip dynamic table size updates
+	while (i < len && (p[i] & 0xe0) == 0x20) {
+		if ((p[i++] & 0x1f) == 0x1f) {
+			while (i < len && (p[i] & 0x80))
+				i++;
+			i++;
+		}
+	}
+	if (i >= len)
+		return 0;
+
+	// indexed header field
+	if (p[i] & 0x80) {
+		switch (p[i] & 0x7f) {
+			case HPACK_STATUS_200: return 200;
+			case 9: return 204;
+			case 10: return 206;
+			case 11: return 304;
+			case 12: return 400;
+			case 13: return 404;
+			case 14: return 500;
+		}
+		return 599;	// dynamic table status, this is not a 200
+	}
+
+	// literal header field, the name is one of the :status entries in the static table
+	int name = (p[i] & 0x40) ? (p[i] & 0x3f) : (p[i] & 0x0f);
+	if (name < HPACK_STATUS_200 || name > HPACK_STATUS_500)
+		return 0;
+	i++;
+	if (i + 1 >= len)
+		return 0;
+	int huffman = p[i] & 0x80;
+	int slen = p[i++] & 0x7f;
+	if (i + slen > len)
+		return 0;
+	if (huffman)
+		return hpack_huffman_status(p + i, slen);
+	if (slen == 3 && isdigit(p[i]) && isdigit(p[i + 1]) && isdigit(p[i + 2]))
+		return (p[i] - '0') * 100 + (p[i + 1] - '0') * 10 + p[i + 2] - '0';
+	return 599;
+}
+
+//**************************************************************************
+// frames
+//**************************************************************************
+static H2Stream *find_stream(H2Conn *h, uint32_t id) {
+	int i;
+	for (i = 0; i < H2_STREAMS_MAX; i++) {
+		if (h->stream[i].state == H2_STREAM_OPEN && h->stream[i].id == id)
+			return &h->stream[i];
+	}
+	return NULL;
+}
+
+static void stream_close(H2Conn *h, H2Stream *s, H2StreamState state) {
+	assert(s->state == H2_STREAM_OPEN);
+	s->state = state;
+	assert(h->active);
+	h->active--;
+}
+
+static void stream_end(H2Conn *h, H2Stream *s) {
+	if (s->status == 200 && s->len > 0)
+		stream_close(h, s, H2_STREAM_DONE);
+	else {
+		if (arg_debug)
+			printf("(%d) h2 stream %u, HTTP status %d, %d bytes\n", arg_id, s->id, s->status, s->len);
+		stream_close(h, s, H2_STREAM_ERROR);
+	}
+}
+
+// the status is extracted from the first fragment of the first header block
+static void header_block(H2Stream *s, const uint8_t *p, int len) {
+	if (s && s->status == 0 && len > 0) {
+		s->status = hpack_status(p, len);
+		if (s->status == 0)
+			s->status = 599;
+	}
+}
+
+// returns -1 if connection error
+static int frame(H2Conn *h, uint8_t type, uint8_t flags, uint32_t id, uint8_t *p, uint32_t len) {
+	if (arg_debug)
+		printf("(%d) h2 rx frame type %u, flags 0x%02x, stream %u, len %u\n", arg_id, type, flags, id, len);
+
+	// a header block must be continued without interruptions
+	if (h->cont_id && (type != H2_CONTINUATION || id != h->cont_id))
+		return -1;
+
+	// flow control is based on the full frame, padding included
+	if (type == H2_DATA)
+		h->recv_consumed += len;
+
+	// remove padding
+	if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED)) {
+		if (len < 1 || p[0] >= len)
+			return -1;
+		len -= p[0] + 1;
+		p++;
+	}
+
+	switch (type) {
+	case H2_DATA: {
+		H2Stream *s = find_stream(h, id);
+		if (!s)
+			break; // probably reset or abandoned
+		if (s->len + (int) len > s->max)
+			stream_close(h, s, H2_STREAM_ERROR);
+		else {
+			memcpy(s->data + s->len, p, len);
+			s->len += len;
+			if (flags & H2_FLAG_END_STREAM)
+				stream_end(h, s);
+		}
+		break;
+	}
+
+	case H2_HEADERS: {
+		if (flags & H2_FLAG_PRIORITY) {
+			if (len < 5)
+				return -1;
+			p += 5;
+			len -= 5;
+		}
+
+		H2Stream *s = find_stream(h, id);
+		header_block(s, p, len);
+		if (!(flags & H2_FLAG_END_HEADERS))
+			h->cont_id = id;
+		if (s && (flags & H2_FLAG_END_STREAM))
+			stream_end(h, s);
+		break;
+	}
+
+	case H2_CONTINUATION: {
+		H2Stream *s = find_stream(h, id);
+		header_block(s, p, len);
+		if (flags & H2_FLAG_END_HEADERS)
+			h->cont_id = 0;
+		break;
+	}
+
+	case H2_RST_STREAM: {
+		if (len != 4)
+			return -1;
+		H2Stream *s = find_stream(h, id);
+		if (s)
+			stream_close(h, s, (get32(p) == H2_REFUSED_STREAM) ? H2_STREAM_REFUSED : H2_STREAM_ERROR);
+		break;
+	}
+
+	case H2_SETTINGS: {
+		if (id != 0 || len % 6)
+			return -1;
+		if (flags & H2_FLAG_ACK)
+			break;
+
+		uint32_t i;
+		for (i = 0; i < len; i += 6) {
+			uint16_t param = (p[i] << 8) | p[i + 1];
+			uint32_t value = get32(p + i + 2);
+
+			if (param == H2_SETTINGS_HEADER_TABLE_SIZE) {
+				if (value != h->table_size) {
+					// the headers stored in the server table might be evicted
+					if (h->indexed)
+						h->goaway = 1;
+					h->table_size = value;
+					h->table_update = 1;
+				}
+			}
+			else if (param == H2_SETTINGS_MAX_CONCURRENT_STREAMS) {
+				if (value < h->max_streams)
+					h->max_streams = value;
+			}
+			else if (param == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+				if (value > H2_STREAM_ID_MAX)
+					return -1;
+				h->stream_window = value;
+			}
+		}
+		h->settings = 1;
+		h->settings_ack++;
+		break;
+	}
+
+	case H2_PUSH_PROMISE:
+		return -1;	// disabled in our SETTINGS
+
+	case H2_PING:
+		if (len != 8)
+			return -1;
+		if (!(flags & H2_FLAG_ACK)) {
+			// only the last PING is acknowledged if they come in faster than we can answer
+			h->ping_ack = 1;
+			memcpy(h->ping_data, p, 8);
+		}
+		else
+			h->ping = 0;
+		break;
+
+	case H2_GOAWAY: {
+		if (len < 8)
+			return -1;
+		uint32_t last = get32(p) & H2_STREAM_ID_MAX;
+		h->goaway = 1;
+
+		// the streams above the last one were not processed by the server (RFC 7540 6.8)
+		int i;
+		for (i = 0; i < H2_STREAMS_MAX; i++) {
+			H2Stream *s = &h->stream[i];
+			if (s->state == H2_STREAM_OPEN && s->id > last)
+				stream_close(h, s, H2_STREAM_REFUSED);
+		}
+		if (arg_debug)
+			printf("(%d) h2 GOAWAY, last stream %u, error %u\n", arg_id, last, get32(p + 4));
+		break;
+	}
+
+	case H2_WINDOW_UPDATE:
+		if (len != 4)
+			return -1;
+		if (id == 0)
+			h->send_window += get32(p) & H2_STREAM_ID_MAX;
+		break;
+
+	default: // PRIORITY and unknown frame types are ignored
+		break;
+	}
+
+	return 0;
+}
+
+//**************************************************************************
+// public interface
+//**************************************************************************
+// initialize the connection and queue the client preface
+void h2_init(H2Conn *h, int max_streams) {
+	assert(h);
+	memset(h, 0, sizeof(H2Conn));
+	h->next_id = 1;
+	h->max_streams = (max_streams > 0 && max_streams < H2_STREAMS_MAX) ? max_streams : H2_STREAMS_MAX;
+	h->send_window = H2_WINDOW_DEFAULT;
+	h->stream_window = H2_WINDOW_DEFAULT;
+	h->table_size = H2_TABLE_SIZE_DEFAULT;
+
+	memcpy(h->out, preface, sizeof(preface) - 1);
+	h->outlen = sizeof(preface) - 1;
+
+	// no server push, no server-initiated streams, no dynamic table for the response headers
+	uint8_t *p = frame_start(h, H2_SETTINGS, 0, 0, 18);
+	assert(p);
+	p[0] = 0;
+	p[1] = H2_SETTINGS_ENABLE_PUSH;
+	put32(p + 2, 0);
+	p[6] = 0;
+	p[7] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	put32(p + 8, 0);
+	p[12] = 0;
+	p[13] = H2_SETTINGS_HEADER_TABLE_SIZE;
+	put32(p + 14, 0);
+
+	// open the connection receive window
+	send_window_update(h, 0, H2_RECV_WINDOW - H2_WINDOW_DEFAULT);
+}
+
+// returns 1 if a new stream can be opened on the connection
+int h2_available(H2Conn *h) {
+	assert(h);
+	return h->settings && !h->goaway && h->active < h->max_streams &&
+		h->next_id < H2_STREAM_ID_MAX;
+}
+
+// queue a DNS request; returns the stream index, -1 if no stream is available
+int h2_request(H2Conn *h, const char *host, const char *path,
+	       const uint8_t *msg, int len, uint8_t *resp, int resp_max) {
+	assert(h);
+	assert(host);
+	assert(path);
+	assert(msg);
+	assert(resp);
+	if (!h2_available(h) || len > h->send_window || len > h->stream_window)
+		return -1;
+
+	int i;
+	for (i = 0; i < H2_STREAMS_MAX; i++) {
+		if (h->stream[i].state == H2_STREAM_FREE)
+			break;
+	}
+	if (i == H2_STREAMS_MAX)
+		return -1;
+
+	// HEADERS + DATA frames
+	uint8_t hdr[512];
+	if (strlen(host) + strlen(path) > sizeof(hdr) - 128)
+		return -1;
+	// the encoder state is restored if the frames don't fit, the server never sees this header block
+	int indexed = h->indexed;
+	int table_update = h->table_update;
+	int hlen = hpack_request(h, hdr, host, path, len);
+	if (h->outlen + 2 * H2_FRAME_HEADER + hlen + len > H2_OUTBUF - H2_CONTROL_RESERVE) {
+		h->indexed = indexed;
+		h->table_update = table_update;
+		return -1;
+	}
+
+	H2Stream *s = &h->stream[i];
+	memset(s, 0, sizeof(H2Stream));
+	s->id = h->next_id;
+	h->next_id += 2;
+
+	uint8_t *p = frame_start(h, H2_HEADERS, H2_FLAG_END_HEADERS, s->id, hlen);
+	memcpy(p, hdr, hlen);
+	p = frame_start(h, H2_DATA, H2_FLAG_END_STREAM, s->id, len);
+	memcpy(p, msg, len);
+	h->send_window -= len;
+
+	s->state = H2_STREAM_OPEN;
+	s->data = resp;
+	s->max = resp_max;
+	h->active++;
+	return i;
+}
+
+// queue a PING frame, used as a keepalive on idle connections; returns -1 if the output buffer is full
+int h2_ping(H2Conn *h) {
+	assert(h);
+	if (h->outlen + H2_FRAME_HEADER + 8 > H2_OUTBUF - H2_CONTROL_RESERVE)
+		return -1;
+	uint8_t *p = frame_start(h, H2_PING, 0, 0, 8);
+	memset(p, 0, 8);
+	h->ping = 1;
+	return 0;
+}
+
+// process incoming data; returns -1 if connection error
+// queue the acknowledgments and the WINDOW_UPDATE that didn't fit in the output buffer before;
+// called again after the output buffer was written out
+void h2_control(H2Conn *h) {
+	assert(h);
+	while (h->settings_ack && frame_start(h, H2_SETTINGS, H2_FLAG_ACK, 0, 0))
+		h->settings_ack--;
+
+	if (h->ping_ack) {
+		uint8_t *p = frame_start(h, H2_PING, H2_FLAG_ACK, 0, 8);
+		if (p) {
+			memcpy(p, h->ping_data, 8);
+			h->ping_ack = 0;
+		}
+	}
+
+	// the receive credit is kept until the frame is queued
+	if (h->recv_consumed >= H2_WINDOW_UPDATE_THRESHOLD && send_window_update(h, 0, h->recv_consumed) == 0)
+		h->recv_consumed = 0;
+}
+
+int h2_input(H2Conn *h, const uint8_t *buf, int len) {
+	assert(h);
+	assert(buf);
+
+	while (len > 0) {
+		int space = (int) sizeof(h->in) - h->inlen;
+		int n = (len < space) ? len : space;
+		memcpy(h->in + h->inlen, buf, n);
+		h->inlen += n;
+		buf += n;
+		len -= n;
+
+		// process all the complete frames
+		uint8_t *p = h->in;
+		int left = h->inlen;
+		while (left >= H2_FRAME_HEADER) {
+			uint32_t flen = (p[0] << 16) | (p[1] << 8) | p[2];
+			if (flen > H2_FRAME_MAX)
+				return -1;
+			if (left < H2_FRAME_HEADER + (int) flen)
+				break;
+
+			if (frame(h, p[3], p[4], get32(p + 5) & H2_STREAM_ID_MAX, p + H2_FRAME_HEADER, flen))
+				return -1;
+			p += H2_FRAME_HEADER + flen;
+			left -= H2_FRAME_HEADER + flen;
+		}
+		memmove(h->in, p, left);
+		h->inlen = left;
+		h2_control(h);
+	}
+
+	return 0;
+}
+
+// release a stream after the response was processed by the caller
+void h2_stream_free(H2Conn *h, int index) {
+	assert(h);
+	assert(index >= 0 && index < H2_STREAMS_MAX);
+	H2Stream *s = &h->stream[index];
+	if (s->state == H2_STREAM_OPEN) {
+		// abandoned stream, let the server know we are not interested in the response
+		uint8_t *p = frame_start(h, H2_RST_STREAM, 0, s->id, 4);
+		if (p)
+			put32(p, H2_CANCEL);
+		stream_close(h, s, H2_STREAM_ERROR);
+	}
+	s->state = H2_STREAM_FREE;
+	s->data = NULL;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019-2020 FDNS Authors
+ *
+ * This file is part of fdns project
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef H2_H
+#define H2_H
+
+#include <stdint.h>
+
+// HTTP/2 client transport (RFC 7540) with HPACK header compression (RFC 7541)
+// The code only parses and builds frames; the caller moves the bytes in and out
+// of the SSL connection.
+
+#define H2_STREAMS_MAX 32	// maximum number of concurrent streams on a connection
+#define H2_STREAMS_DEFAULT 16	// default for servers without a "streams:" entry
+#define H2_FRAME_HEADER 9
+#define H2_FRAME_MAX 16384	// default SETTINGS_MAX_FRAME_SIZE, we never change it
+#define H2_OUTBUF 4096	// outgoing frames buffer
+#define H2_CONTROL_RESERVE 64	// space in the output buffer kept for SETTINGS/PING acknowledgments and WINDOW_UPDATE
+
+typedef enum {
+	H2_STREAM_FREE = 0,
+	H2_STREAM_OPEN,	// request sent, waiting for the response
+	H2_STREAM_DONE,	// full response received
+	H2_STREAM_ERROR,	// HTTP error, reset or truncated stream
+	H2_STREAM_REFUSED	// never processed by the server (GOAWAY, REFUSED_STREAM), safe to send again
+} H2StreamState;
+
+typedef struct h2_stream_t {
+	H2StreamState state;
+	uint32_t id;
+	int status;	// HTTP status code, 0 if not received yet
+	uint8_t *data;	// response buffer provided by the caller
+	int len;	// response length
+	int max;	// response buffer size
+} H2Stream;
+
+typedef struct h2_conn_t {
+	int settings;	// SETTINGS frame received from the server
+	int goaway;	// GOAWAY received or connection unusable, no new streams
+	uint32_t next_id;	// next client stream id
+	uint32_t max_streams;	// concurrent streams limit
+	uint32_t active;	// streams in H2_STREAM_OPEN state
+	int32_t send_window;	// connection flow-control window for outgoing data
+	int32_t stream_window;	// initial flow-control window for outgoing stream data
+	uint32_t recv_consumed;	// data received since the last WINDOW_UPDATE we sent
+	uint32_t table_size;	// server HPACK dynamic table size
+	int table_update;	// dynamic table size update pending
+	int indexed;	// request headers already stored in the server dynamic table
+	uint32_t cont_id;	// stream id of a header block continued in CONTINUATION frames
+	int ping;	// PING sent, waiting for the acknowledgment
+	int settings_ack;	// SETTINGS frames received and not acknowledged yet
+	int ping_ack;	// PING received and not acknowledged yet
+	uint8_t ping_data[8];
+
+	// incoming frame
+	uint8_t in[H2_FRAME_HEADER + H2_FRAME_MAX];
+	int inlen;
+
+	// outgoing frames
+	uint8_t out[H2_OUTBUF];
+	int outlen;
+
+	H2Stream stream[H2_STREAMS_MAX];
+} H2Conn;
+
+void h2_init(H2Conn *h, int max_streams);
+int h2_available(H2Conn *h);
+int h2_request(H2Conn *h, const char *host, const char *path,
+	       const uint8_t *msg, int len, uint8_t *resp, int resp_max);
+int h2_input(H2Conn *h, const uint8_t *buf, int len);
+int h2_ping(H2Conn *h);
+void h2_control(H2Conn *h);
+void h2_stream_free(H2Conn *h, int index);
+
+#endif
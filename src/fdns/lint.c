@@ -46,6 +46,7 @@ const char *lint_err2str(void) {
 //***********************************************
 static DnsHeader hdr;
 static DnsQuestion question;
+static int ttl_min = -1;	// smallest TTL in the last response checked by lint_rx(), -1 if none
 
 // check chars in domain name: a-z, A-Z, and 0-9
 // return 0 if ok, 1 if bad
@@ -145,6 +146,54 @@ static int skip_name(uint8_t **pkt, uint8_t *last) {
 }
 
 
+// extract the resource record header; pkt is left at the start of the record data
+// return -1 if error, 0 if ok
+static int get_rr(uint8_t **pkt, uint8_t *last, DnsRR *rr) {
+	if (skip_name(pkt, last))
+		return -1;
+	if (*pkt + sizeof(DnsRR) - 1 > last) {
+		dnserror = DNSERR_INVALID_PKT_LEN;
+		return -1;
+	}
+	memcpy(rr, *pkt, sizeof(DnsRR));
+	rr->type = ntohs(rr->type);
+	rr->cls = ntohs(rr->cls);
+	rr->ttl = ntohl(rr->ttl);
+	rr->rlen = ntohs(rr->rlen);
+	*pkt += sizeof(DnsRR);
+	if (*pkt + rr->rlen - 1 > last) {
+		dnserror = DNSERR_INVALID_PKT_LEN;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void set_ttl(uint32_t ttl) {
+	if (ttl > INT32_MAX)	// RFC 2181: TTL values with the top bit set are treated as zero
+		ttl = 0;
+	if (ttl_min == -1 || (int) ttl < ttl_min)
+		ttl_min = (int) ttl;
+}
+
+// negative caching (RFC 2308): the TTL of a response without answers is the SOA record TTL,
+// bounded by the SOA minimum field; pkt positioned at the start of the authority section
+static void soa_ttl(uint8_t *pkt, uint8_t *last, unsigned cnt) {
+	unsigned i;
+	for (i = 0; i < cnt; i++) {
+		DnsRR rr;
+		if (get_rr(&pkt, last, &rr))
+			return;
+		if (rr.type == 6 && rr.rlen >= 22) { // SOA: two names and five 32-bit fields
+			uint32_t minimum;
+			memcpy(&minimum, pkt + rr.rlen - 4, 4);
+			minimum = ntohl(minimum);
+			set_ttl((rr.ttl < minimum) ? rr.ttl : minimum);
+			return;
+		}
+		pkt += rr.rlen;
+	}
+}
+
 //***********************************************
 // public interface
 //***********************************************
@@ -233,14 +282,27 @@ int lint_rx(uint8_t *pkt, unsigned len) {
 	assert(len);
 	uint8_t *last = pkt + len - 1;
 	dnserror = DNSERR_OK;
+	ttl_min = -1;
 
 	// check header
 	DnsHeader *h = lint_header(&pkt, last);
 	if (!h)
 		return -1;
 
-	// check errors such as NXDOMAIN
+	// check errors such as NXDOMAIN; the TTL comes from the SOA record, if any
 	if ((h->flags & 0x000f) != 0) {
+		if (h->questions == 1 && skip_name(&pkt, last) == 0) {
+			pkt += 4;
+			int i;
+			for (i = 0; i < h->answer; i++) {
+				DnsRR rr;
+				if (get_rr(&pkt, last, &rr))
+					break;
+				pkt += rr.rlen;
+			}
+			if (i == h->answer)
+				soa_ttl(pkt, last, h->authority);
+		}
 		dnserror = DNSERR_NXDOMAIN;
 		return -1;
 	}
@@ -259,24 +321,14 @@ int lint_rx(uint8_t *pkt, unsigned len) {
 		return -1;
 	}
 
-	// extract CNAMEs from the answer section
+	// extract CNAMEs and the smallest TTL from the answer section
 	int i;
 	for (i = 0; i < h->answer; i++) {
-		if (skip_name(&pkt, last))
-			return -1;
-
 		// extract record
-		if (pkt + sizeof(DnsRR) > last) {
-			dnserror = DNSERR_INVALID_PKT_LEN;
-			return -1;
-		}
 		DnsRR rr;
-		memcpy(&rr, pkt, sizeof(DnsRR));
-		rr.type = ntohs(rr.type);
-		rr.cls = ntohs(rr.cls);
-		rr.ttl = ntohl(rr.ttl);
-		rr.rlen = ntohs(rr.rlen);
-		pkt += sizeof(DnsRR);
+		if (get_rr(&pkt, last, &rr))
+			return -1;
+		set_ttl(rr.ttl);
 
 //printf("type %u, class %u, ttl %u, rlen %u\n",
 //rr.type, rr.cls, rr.ttl, rr.rlen);
@@ -293,5 +345,43 @@ int lint_rx(uint8_t *pkt, unsigned len) {
 		pkt += rr.rlen;
 	}
 
+	// no data
+	if (h->answer == 0)
+		soa_ttl(pkt, last, h->authority);
 	return 0;
 }
+
+// smallest TTL in the response checked by the last lint_rx() call, -1 if not available
+int lint_ttl(void) {
+	return ttl_min;
+}
+
+// the response was cached elapsed seconds ago: decrement the TTL of all the records
+// pkt positioned at start of packet
+void lint_ttl_update(uint8_t *pkt, unsigned len, uint32_t elapsed) {
+	assert(pkt);
+	assert(len);
+	if (elapsed == 0)
+		return;
+	uint8_t *last = pkt + len - 1;
+
+	DnsHeader *h = lint_header(&pkt, last);
+	if (!h || h->questions != 1)
+		return;
+	if (skip_name(&pkt, last))
+		return;
+	pkt += 4;
+
+	int cnt = h->answer + h->authority + h->additional;
+	int i;
+	for (i = 0; i < cnt; i++) {
+		DnsRR rr;
+		if (get_rr(&pkt, last, &rr))
+			return;
+		if (rr.type != 41) { // the TTL field of the EDNS0 OPT record carries flags
+			uint32_t ttl = htonl((rr.ttl > elapsed) ? rr.ttl - elapsed : 0);
+			memcpy(pkt - sizeof(DnsRR) + 4, &ttl, 4);
+		}
+		pkt += rr.rlen;
+	}
+}
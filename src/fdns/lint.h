@@ -66,4 +66,6 @@ const char *lint_err2str(void);
 DnsHeader *lint_header(uint8_t **pkt, uint8_t *last);
 DnsQuestion *lint_question(uint8_t **pkt, uint8_t *last);
 int lint_rx(uint8_t *pkt, unsigned len);
+int lint_ttl(void);
+void lint_ttl_update(uint8_t *pkt, unsigned len, uint32_t elapsed);
 #endif
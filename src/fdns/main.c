@@ -34,10 +34,31 @@ char *arg_certfile = NULL;
 int arg_test_hosts = 0;
 char *arg_zone = NULL;
 int arg_cache_ttl = CACHE_TTL_DEFAULT;
+int arg_cache_min_ttl = CACHE_MIN_TTL_DEFAULT;
+int arg_cache_max_reply = MAXBUF;
+int arg_cache_size = CACHE_SIZE_DEFAULT;
+int arg_connect_timeout = TIMEOUT_CONNECT_DEFAULT;
+int arg_write_timeout = TIMEOUT_WRITE_DEFAULT;
+int arg_read_timeout = TIMEOUT_READ_DEFAULT;
+int arg_reconnect_wait = RECONNECT_WAIT_DEFAULT;
 int arg_allow_local_doh = 0;
+int arg_ktls = 0;
+SchedType arg_scheduler = SCHED_LATENCY;
+int arg_hedge_rate = HEDGE_RATE_DEFAULT;
+static char *benchmark_domains = NULL;	// --benchmark-domains file
 
 Stats stats;
 
+static int timeout_arg(const char *str) {
+	int val = atoi(str);
+	if (val < TIMEOUT_MIN || val > TIMEOUT_MAX) {
+		fprintf(stderr, "Error: please provide a timeout between %d and %d milliseconds\n",
+			TIMEOUT_MIN, TIMEOUT_MAX);
+		exit(1);
+	}
+	return val;
+}
+
 static void usage(void) {
 	printf("fdns - DNS over HTTPS proxy server\n\n");
 	printf("Usage:\n");
@@ -49,15 +70,29 @@ static void usage(void) {
 	       "\tA queries are allowed.\n");
 	printf("    --allow-local-doh - allow applications on local network to connect to DoH\n"
 	       "\tservices; disabled by default.\n");
-	printf("    --cache-ttl=seconds - change DNS cache TTL (default %ds).\n", CACHE_TTL_DEFAULT);
+	printf("    --benchmark - test the DoH servers in your current zone in parallel and\n"
+	       "\tprint a table ranked by the response time.\n");
+	printf("    --benchmark=server-name|tag|all - benchmark DoH servers.\n");
+	printf("    --benchmark-domains=filename - domains used by --benchmark, one on each\n"
+	       "\tline.\n");
+	printf("    --cache-max-reply=bytes - responses larger than this are not cached\n"
+	       "\t(default %d bytes).\n", MAXBUF);
+	printf("    --cache-min-ttl=seconds - minimum DNS cache TTL (default %ds).\n", CACHE_MIN_TTL_DEFAULT);
+	printf("    --cache-size=MB - DNS cache memory limit for each resolver process\n"
+	       "\t(default %d MB).\n", CACHE_SIZE_DEFAULT);
+	printf("    --cache-ttl=seconds - maximum DNS cache TTL (default %ds).\n", CACHE_TTL_DEFAULT);
 	printf("    --certfile=filename - SSL certificate file in PEM format.\n");
+	printf("    --connect-timeout=ms - DoH connection setup timeout (default %dms).\n", TIMEOUT_CONNECT_DEFAULT);
 	printf("    --daemonize - detach from the controlling terminal and run as a Unix\n"
 	       "\tdaemon.\n");
 	printf("    --debug - print debug messages.\n");
 	printf("    --forwarder=domain@address - conditional forwarding to a different DNS\n"
 	        "\tserver.\n");
+	printf("    --hedge-rate=percent - send a slow DoH query to a second server, at most\n"
+	       "\tfor this percentage of the queries (default %d%%, 0 disables).\n", HEDGE_RATE_DEFAULT);
 	printf("    --help, -?, -h - show this help screen.\n");
 	printf("    --ipv6 - allow AAAA requests.\n");
+	printf("    --ktls - hand the TLS record encryption for DoH connections to the kernel.\n");
 	printf("    --list - list DoH servers.\n");
 	printf("    --list=server-name|tag|all - list DoH servers.\n");
 	printf("    --monitor - monitor statistics.\n");
@@ -65,9 +100,16 @@ static void usage(void) {
 	printf("    --proxy-addr=address - configure the IP address the proxy listens on for\n"
 	       "\tDNS queries coming from the local clients. The default is 127.1.1.1.\n");
 	printf("    --proxy-addr-any - listen on all available network interfaces.\n");
+	printf("    --read-timeout=ms - time to wait for a DoH response before the query is\n"
+	       "\tmoved to a different server (default %dms).\n", TIMEOUT_READ_DEFAULT);
+	printf("    --reconnect-wait=ms - time a query waits for a DoH connection to come back\n"
+	       "\tbefore it is sent to the fallback server (default %dms, 0 disables).\n",
+	       RECONNECT_WAIT_DEFAULT);
 	printf("    --resolvers=number - the number of resolver processes, between %d and %d,\n"
 	       "\tdefault %d.\n",
 	       RESOLVERS_CNT_MIN, RESOLVERS_CNT_MAX, RESOLVERS_CNT_DEFAULT);
+	printf("    --scheduler=latency|random|hash - the way queries are spread across the\n"
+	       "\tservers in the pool; by default the faster servers get more queries.\n");
 	printf("    --server=server-name|tag|all - DoH server to connect to.\n");
 	printf("    --test-hosts - test the domains in /etc/fdns/hosts file.\n");
 	printf("    --test-server - test the DoH servers in your current zone.\n");
@@ -75,6 +117,7 @@ static void usage(void) {
 	printf("    --test-url=URL - check if URL is dropped.\n");
 	printf("    --test-url-list - check all URLs form stdin.\n");
 	printf("    --version - print program version and exit.\n");
+	printf("    --write-timeout=ms - DoH write timeout (default %dms).\n", TIMEOUT_WRITE_DEFAULT);
 	printf("    --zone=zone-name - set a different geographical zone.\n");
 	printf("\n");
 }
@@ -103,6 +146,8 @@ int main(int argc, char **argv) {
 			}
 			else if (strcmp(argv[i], "--debug") == 0)
 				arg_debug = 1;
+			else if (strncmp(argv[i], "--benchmark-domains=", 20) == 0)
+				benchmark_domains = argv[i] + 20;
 		}
 	}
 
@@ -130,6 +175,8 @@ int main(int argc, char **argv) {
 				;
 			else if (strncmp(argv[i], "--zone=", 7) == 0)
 				;
+			else if (strncmp(argv[i], "--benchmark-domains=", 20) == 0)
+				;
 
 			// options
 			else if (strncmp(argv[i], "--cache-ttl=", 12) == 0) {
@@ -140,8 +187,46 @@ int main(int argc, char **argv) {
 					exit(1);
 				}
 			}
+			else if (strncmp(argv[i], "--cache-max-reply=", 18) == 0) {
+				arg_cache_max_reply = atoi(argv[i] + 18);
+				if (arg_cache_max_reply < CACHE_REPLY_MIN || arg_cache_max_reply > MAXBUF) {
+					fprintf(stderr, "Error: please provide a cached response size between %d and %d bytes\n",
+						CACHE_REPLY_MIN, MAXBUF);
+					exit(1);
+				}
+			}
+			else if (strncmp(argv[i], "--cache-min-ttl=", 16) == 0) {
+				arg_cache_min_ttl = atoi(argv[i] + 16);
+				if (arg_cache_min_ttl < 0 || arg_cache_min_ttl > CACHE_MIN_TTL_MAX) {
+					fprintf(stderr, "Error: please provide a minimum cache TTL between 0 and %d seconds\n",
+						CACHE_MIN_TTL_MAX);
+					exit(1);
+				}
+			}
+			else if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+				arg_cache_size = atoi(argv[i] + 13);
+				if (arg_cache_size < 1 || arg_cache_size > CACHE_SIZE_MAX) {
+					fprintf(stderr, "Error: please provide a cache size between 1 and %d MB\n",
+						CACHE_SIZE_MAX);
+					exit(1);
+				}
+			}
 			else if (strncmp(argv[i], "--certfile=", 11) == 0)
 				arg_certfile = argv[i] + 11;
+			else if (strncmp(argv[i], "--connect-timeout=", 18) == 0)
+				arg_connect_timeout = timeout_arg(argv[i] + 18);
+			else if (strncmp(argv[i], "--write-timeout=", 16) == 0)
+				arg_write_timeout = timeout_arg(argv[i] + 16);
+			else if (strncmp(argv[i], "--read-timeout=", 15) == 0)
+				arg_read_timeout = timeout_arg(argv[i] + 15);
+			else if (strncmp(argv[i], "--reconnect-wait=", 17) == 0) {
+				arg_reconnect_wait = atoi(argv[i] + 17);
+				if (arg_reconnect_wait < 0 || arg_reconnect_wait > TIMEOUT_MAX) {
+					fprintf(stderr, "Error: please provide a reconnect wait between 0 and %d milliseconds\n",
+						TIMEOUT_MAX);
+					exit(1);
+				}
+			}
 			else if (strcmp(argv[i], "--allow-all-queries") == 0)
 				arg_allow_all_queries = 1;
 			else if (strcmp(argv[i], "--allow-local-doh") == 0) {
@@ -152,6 +237,25 @@ int main(int argc, char **argv) {
 				arg_nofilter = 1;
 			else if (strcmp(argv[i], "--ipv6") == 0)
 				arg_ipv6 = 1;
+			else if (strcmp(argv[i], "--ktls") == 0)
+				arg_ktls = 1;
+			else if (strcmp(argv[i], "--scheduler=latency") == 0)
+				arg_scheduler = SCHED_LATENCY;
+			else if (strcmp(argv[i], "--scheduler=random") == 0)
+				arg_scheduler = SCHED_RANDOM;
+			else if (strcmp(argv[i], "--scheduler=hash") == 0)
+				arg_scheduler = SCHED_HASH;
+			else if (strncmp(argv[i], "--hedge-rate=", 13) == 0) {
+				arg_hedge_rate = atoi(argv[i] + 13);
+				if (arg_hedge_rate < 0 || arg_hedge_rate > HEDGE_RATE_MAX) {
+					fprintf(stderr, "Error: please provide a hedge rate between 0 and %d\n", HEDGE_RATE_MAX);
+					exit(1);
+				}
+			}
+			else if (strncmp(argv[i], "--scheduler=", 12) == 0) {
+				fprintf(stderr, "Error: unknown scheduler %s\n", argv[i] + 12);
+				exit(1);
+			}
 			else if (strncmp(argv[i], "--resolvers=", 12) == 0) {
 				arg_resolvers = atoi(argv[i] + 12);
 				if (arg_resolvers < RESOLVERS_CNT_MIN || arg_resolvers > RESOLVERS_CNT_MAX) {
@@ -222,6 +326,14 @@ int main(int argc, char **argv) {
 				server_test_tag(argv[i] + 14);
 				return 0;
 			}
+			else if (strcmp(argv[i], "--benchmark") == 0) {
+				server_benchmark(NULL, benchmark_domains);
+				return 0;
+			}
+			else if (strncmp(argv[i], "--benchmark=", 12) == 0) {
+				server_benchmark(argv[i] + 12, benchmark_domains);
+				return 0;
+			}
 			else {
 				fprintf(stderr, "Error: invalid command line argument %s\n", argv[i]);
 				return 1;
@@ -240,6 +352,10 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Error: --proxy-addr and --proxy-addr-any are mutually exclusive\n");
 		exit(1);
 	}
+	if (arg_cache_min_ttl > arg_cache_ttl) {
+		fprintf(stderr, "Error: --cache-min-ttl is larger than --cache-ttl\n");
+		exit(1);
+	}
 
 	//Reloading with different arg server
 	arg_server = NULL;
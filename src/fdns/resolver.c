@@ -17,7 +17,6 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include "fdns.h"
-#include "timetrace.h"
 #include <sys/time.h>
 #include <sys/prctl.h>
 #include <errno.h>
@@ -25,6 +24,361 @@
 #include <time.h>
 
 static uint8_t buf[MAXBUF];
+static int slocal = -1;	// local DNS server
+static int sremote = -1;	// remote DNS fallback server
+static struct sockaddr_in addr_fallback;
+static int dns_over_udp = 0;
+static int frontend_keepalive_cnt = 0;
+static int queries = 0;	// DoH queries in flight
+#define LOCAL_BATCH 32	// queries read from the local socket in one pass
+
+// in-flight table: a query identical to a DoH query already in flight, except for the DNS id,
+// waits for the same response
+typedef struct waiter_t {
+	struct waiter_t *next;
+	struct sockaddr_in addr;	// client address
+	uint8_t id[2];	// client DNS id
+} Waiter;
+
+typedef struct inflight_t {
+	struct inflight_t *next;	// hash table chain
+	uint32_t hash;
+	Waiter *waiters;
+	int cnt;	// number of waiters
+	int len;	// query length, without the DNS id
+	uint8_t query[];
+} Inflight;
+
+#define INFLIGHT_HASH 256
+static Inflight *inflight[INFLIGHT_HASH];
+
+// FNV-1a over the query, the DNS id excluded
+static inline uint32_t inflight_hash(const uint8_t *msg, int len) {
+	uint32_t h = 2166136261u;
+	int i;
+	for (i = 2; i < len; i++)
+		h = (h ^ msg[i]) * 16777619u;
+	return h;
+}
+
+// returns the entry for a query identical to msg, NULL if none
+static Inflight *inflight_find(const uint8_t *msg, int len, uint32_t h) {
+	Inflight *f;
+	for (f = inflight[h % INFLIGHT_HASH]; f; f = f->next) {
+		if (f->hash == h && f->len == len - 2 && memcmp(f->query, msg + 2, len - 2) == 0)
+			return f;
+	}
+	return NULL;
+}
+
+static Inflight *inflight_add(const uint8_t *msg, int len, uint32_t h) {
+	Inflight *f = malloc(sizeof(Inflight) + len - 2);
+	if (!f)
+		errExit("malloc");
+	f->hash = h;
+	f->waiters = NULL;
+	f->cnt = 0;
+	f->len = len - 2;
+	memcpy(f->query, msg + 2, len - 2);
+	f->next = inflight[h % INFLIGHT_HASH];
+	inflight[h % INFLIGHT_HASH] = f;
+	return f;
+}
+
+static void inflight_remove(Inflight *f) {
+	Inflight **ptr = &inflight[f->hash % INFLIGHT_HASH];
+	while (*ptr != f)
+		ptr = &(*ptr)->next;
+	*ptr = f->next;
+}
+
+// send the request in clear to the remote fallback server; store the request in the database
+static void resolver_fallback(uint8_t *msg, ssize_t len, struct sockaddr_in *addr_client) {
+	stats.fallback++;
+	stats.changed = 1;
+	if (!dns_over_udp)
+		rlogprintf("Warning: sending requests in clear\n");
+	dns_over_udp = 1;
+	errno = 0;
+	len = sendto(sremote, msg, len, 0, (struct sockaddr *) &addr_fallback, sizeof(addr_fallback));
+	if(arg_debug)
+		printf("len %ld, errno %d\n", len, errno);
+	if (len == -1) // todo: parse errno - EAGAIN
+		errExit("sendto");
+
+	// store the incoming request in the database
+	dnsdb_store(msg, addr_client);
+}
+
+// the same response goes to the identical queries waiting for it, with their own DNS id
+static void resolver_reply_waiters(DnsQuery *q, uint8_t *reply, int len) {
+	Inflight *f = q->inflight;
+	inflight_remove(f);
+	while (f->waiters) {
+		Waiter *w = f->waiters;
+		f->waiters = w->next;
+		if (len > 0) {
+			memcpy(reply, w->id, 2);
+			ssize_t rv = sendto(slocal, reply, len, 0, (struct sockaddr *) &w->addr, sizeof(w->addr));
+			if (rv == -1) // todo: parse errno - EAGAIN
+				errExit("sendto");
+		}
+		else if (len < 0) {
+			memcpy(q->query, w->id, 2);
+			resolver_fallback(q->query, q->len, &w->addr);
+		}
+		free(w);
+	}
+	free(f);
+}
+
+// the DoH query is finished: reply/len is the response, len is 0 if no DNS data came back,
+// -1 if the request failed and should go to the fallback server
+void resolver_reply(DnsQuery *q, uint8_t *reply, int len) {
+	assert(q);
+	assert(queries > 0);
+
+	// good packet from SSL
+	if (len > 0) {
+		stats.ssl_pkts_timetrace += event_clock() - q->start;
+		stats.ssl_pkts_cnt++;
+		dns_over_udp = 0;
+
+		// we got a response, send the data back to the client
+		errno = 0;
+		ssize_t rv = sendto(slocal, reply, len, 0, (struct sockaddr *) &q->addr, sizeof(q->addr));
+		if(arg_debug)
+			printf("len %ld, errno %d\n", rv, errno);
+		if (rv == -1) // todo: parse errno - EAGAIN
+			errExit("sendto");
+	}
+	// send the data to the remote fallback server
+	else if (len < 0)
+		resolver_fallback(q->query, q->len, &q->addr);
+	// a HTTP error from SSL, with no DNS data comming back - the packet is dropped
+
+	if (q->inflight)
+		resolver_reply_waiters(q, reply, len);
+	free(q);
+	queries--;
+}
+
+//***********************************************
+// frontend keepalive
+//***********************************************
+static void resolver_frontend(int fd, uint32_t events, void *arg) {
+	(void) events;
+	(void) arg;
+	int sz = read(fd, buf, MAXBUF);
+	(void) sz; // todo: error recovery
+	frontend_keepalive_cnt = 0;
+}
+
+//***********************************************
+// data coming from remote DNS fallback server
+//***********************************************
+static void resolver_remote(int fd, uint32_t events, void *arg) {
+	(void) events;
+	(void) arg;
+	struct sockaddr_in remote;
+	memset(&remote, 0, sizeof(remote));
+	socklen_t remote_len = sizeof(struct sockaddr_in);
+	ssize_t len = recvfrom(fd, buf, MAXBUF, 0, (struct sockaddr *) &remote, &remote_len);
+	if (len == -1) // todo: parse errno - EINTR
+		errExit("recvfrom");
+	if(arg_debug)
+		printf("rx remote packet len %ld\n", len);
+
+	// check remote ip address - RFC 5452 (todo - more matches)
+	if (remote.sin_addr.s_addr != addr_fallback.sin_addr.s_addr) {
+		rlogprintf("Error: wrong IP address for fallback response: %d.%d.%d.%d\n",
+			   PRINT_IP(ntohs(remote.sin_addr.s_addr)));
+		return;
+	}
+	if (remote.sin_port != addr_fallback.sin_port) {
+		rlogprintf("Error: wrong UDP port for fallback response: %d\n",
+			   PRINT_IP(ntohs(remote.sin_port)));
+		return;
+	}
+
+	struct sockaddr_in *addr_client = dnsdb_retrieve(buf);
+	if (!addr_client) {
+		rlogprintf("Warning: DNS over UDP request timeout\n");
+		return;
+	}
+	socklen_t addr_client_len = sizeof(struct sockaddr_in);
+
+	// send the data to the local client
+	errno = 0;
+	len = sendto(slocal, buf, len, 0, (struct sockaddr *) addr_client, addr_client_len);
+	if(arg_debug)
+		printf("len %ld, errno %d\n", len, errno);
+	if (len == -1) // todo: parse errno - EAGAIN
+		errExit("sendto");
+}
+
+//***********************************************
+// data coming from a forwarding DNS server
+//***********************************************
+static void resolver_forwarder(int fd, uint32_t events, void *arg) {
+	(void) events;
+	Forwarder *f = arg;
+	struct sockaddr_in remote;
+	memset(&remote, 0, sizeof(remote));
+	socklen_t remote_len = sizeof(struct sockaddr_in);
+	ssize_t len = recvfrom(fd, buf, MAXBUF, 0, (struct sockaddr *) &remote, &remote_len);
+	if (len == -1) // todo: parse errno - EINTR
+		errExit("recvfrom");
+	if(arg_debug)
+		printf("rx remote packet len %ld\n", len);
+
+	// check remote ip address
+	if (remote.sin_addr.s_addr != f->saddr.sin_addr.s_addr) {
+		rlogprintf("Warning: wrong IP address for fwd response: %d.%d.%d.%d\n",
+			   PRINT_IP(ntohl(remote.sin_addr.s_addr)));
+		return;
+	}
+
+	struct sockaddr_in *addr_client = dnsdb_retrieve(buf);
+	if (!addr_client) {
+		rlogprintf("Warning: fwd DNS over UDP request timeout\n");
+		return;
+	}
+	socklen_t addr_client_len = sizeof(struct sockaddr_in);
+
+	// send the data to the local client
+	errno = 0;
+	len = sendto(slocal, buf, len, 0, (struct sockaddr *) addr_client, addr_client_len);
+	if(arg_debug)
+		printf("len %ld, errno %d\n", len, errno);
+	if (len == -1) // todo: parse errno - EAGAIN
+		errExit("sendto");
+}
+
+//***********************************************
+// data coming from the local network  - Respond to request here
+//***********************************************
+static void resolver_local(int fd, uint32_t events, void *arg) {
+	(void) events;
+	(void) arg;
+
+	// read all the queries waiting in the socket, up to LOCAL_BATCH; the DoH requests
+	// are sent upstream together at the end of the event loop pass
+	int i;
+	for (i = 0; i < LOCAL_BATCH; i++) {
+		struct sockaddr_in addr_client;
+		socklen_t addr_client_len = sizeof(struct sockaddr_in);
+
+		ssize_t len = recvfrom(fd, buf, MAXBUF, MSG_DONTWAIT, (struct sockaddr *) &addr_client, &addr_client_len);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			errExit("recvfrom");
+		}
+		if(arg_debug)
+			printf("rx local packet len %ld\n", len);
+		stats.rx++;
+		stats.changed = 1;
+
+		// filter incoming requests
+		char* domain = NULL;
+		DnsDestination dest;
+		uint8_t *r = dns_parser_domain(buf, &len, &dest, &domain);
+		rlogprintf(" ----------------------------\n - Received request for domain %s\n ----------------------------\n", domain);
+
+		assert(dest < DEST_MAX);
+		if (dest != DEST_SSL)
+			free(domain);	// the domain name is used only to pick a server from the pool
+		if (dest == DEST_DROP) {
+			stats.drop++;
+			continue;
+		}
+
+		else if (dest == DEST_LOCAL) {
+			assert(r);
+
+			printf("(%d) Cache DNS data:\n", arg_id);
+			print_mem((uint8_t *) buf, 150);
+
+			// send the loopback response
+			len = sendto(slocal, r, len, 0, (struct sockaddr *) &addr_client, addr_client_len);
+
+			if(arg_debug)
+				printf("len %ld, errno %d\n", len, errno);
+			if (len == -1) // todo: parse errno - EAGAIN
+				errExit("sendto");
+			continue;
+		}
+
+		else if (dest == DEST_FORWARDING) {
+			assert(fwd_active);
+
+			errno = 0;
+			len = sendto(fwd_active->sock, buf, len, 0, (struct sockaddr *) &fwd_active->saddr, fwd_active->slen);
+			if(arg_debug)
+				printf("len %ld, errno %d\n", len, errno);
+			if (len == -1) // todo: parse errno - EAGAIN
+				errExit("sendto");
+
+			// store the incoming request in the database
+			dnsdb_store(buf, &addr_client);
+			fwd_active = NULL;
+			continue;
+		}
+
+		// attempt to send the data over SSL; the request is not stored in the database
+		assert(dest == DEST_SSL);
+
+		// an identical query is already in flight, wait for its response
+		uint32_t h = inflight_hash(buf, len);
+		Inflight *f = inflight_find(buf, len, h);
+		if (f && f->cnt < COALESCE_MAX) {
+			Waiter *w = malloc(sizeof(Waiter));
+			if (!w)
+				errExit("malloc");
+			memcpy(&w->addr, &addr_client, sizeof(addr_client));
+			memcpy(w->id, buf, 2);
+			w->next = f->waiters;
+			f->waiters = w;
+			f->cnt++;
+			stats.coalesced++;
+			if (arg_debug)
+				printf("(%d) %s coalesced with a query in flight\n", arg_id, domain);
+			free(domain);
+			continue;
+		}
+		if (queries >= QUERY_MAX) {
+			rlogprintf("Warning: too many DoH queries in flight, dropped\n");
+			stats.drop++;
+			free(domain);
+			continue;
+		}
+
+		DnsQuery *q = malloc(sizeof(DnsQuery));
+		if (!q)
+			errExit("malloc");
+		q->next = NULL;
+		q->keepalive = 0;
+		q->start = event_clock();
+		q->deadline = 0;
+		q->retry = 0;
+		q->abandoned = 0;
+		q->hedged = 0;
+		q->lost = 0;
+		q->hedge = NULL;
+		q->inflight = (f) ? NULL : inflight_add(buf, len, h);
+		memcpy(&q->addr, &addr_client, sizeof(addr_client));
+		strcpy(q->cname, cache_get_name(&q->cname_type));	// the reply is cached under this name
+		q->stream = -1;
+		q->len = len;
+		memcpy(q->query, buf, len);
+		queries++;
+
+		// the response comes back later in resolver_reply()
+		ssl_dns_pool(domain, q);
+		free(domain);
+	}
+}
 
 void resolver(void) {
 	// we get a SIGPIPE if we write to a socket closed by the other end;
@@ -35,14 +389,14 @@ void resolver(void) {
 	if (!arg_nofilter)
 		filter_load_all_lists();
 
-	// connect SSL/DNS server
+	// connect SSL/DNS servers in the pool, resuming the TLS sessions of the previous resolver process
 	ssl_init();
+	ssl_session_load();
 	ssl_open();
-	ssl_keepalive();
 
 	// start the local DNS server on 127.0.0.1 only
 	// in order to mitigate DDoS amplification attacks
-	int slocal = net_local_dns_socket();
+	slocal = net_local_dns_socket();
 	assert(slocal > 0);
 
 	// security
@@ -52,349 +406,91 @@ void resolver(void) {
 		seccomp_resolver();
 
 	// Remote dns server fallback server
-	struct sockaddr_in addr_fallback;
-	int sremote = net_remote_dns_socket(&addr_fallback, "9.9.9.9");
-	socklen_t addr_fallback_len = sizeof(addr_fallback);
+	sremote = net_remote_dns_socket(&addr_fallback, "9.9.9.9");
 
 	// initialize database - we use this database for the fallback server
 	// in order to match DNS responses and DNS requests
 	dnsdb_init();
 
+	// register the sockets with the event loop; the pool SSL connections are registered by ssl.c
+	event_add(slocal, EPOLLIN, resolver_local, NULL);
+	event_add(sremote, EPOLLIN, resolver_remote, NULL);
+	Forwarder *f = fwd;
+	while (f) {
+		event_add(f->sock, EPOLLIN, resolver_forwarder, f);
+		f = f->next;
+	}
+	// communication with the frontend process
+	event_add(arg_fd, EPOLLIN, resolver_frontend, NULL);
+
 	fflush(0);
 	int resolver_keepalive_cnt = (RESOLVER_KEEPALIVE_TIMER * arg_id) / arg_resolvers;
-	DnsServer *srv = server_get();
-	assert(srv);
-	int ssl_keepalive_timer = srv->ssl_keepalive;
-	int ssl_keepalive_cnt = ssl_keepalive_timer;
 	int console_printout_cnt = CONSOLE_PRINTOUT_TIMER;
 	int ssl_reopen_cnt = SSL_REOPEN_TIMER;
 
 	console_printout_cnt = (CONSOLE_PRINTOUT_TIMER * arg_id) / arg_resolvers;
-	int dns_over_udp = 0;
 
-	struct timeval t = { 1, 0};	// one second timeout
 	time_t timestamp = time(NULL);	// detect the computer going to sleep in order to reinitialize SSL connections
-	int frontend_keepalive_cnt = 0;
 	while (1) {
-		fd_set fds;
-		FD_ZERO(&fds);
-		// UDP sockets
-		FD_SET(slocal, &fds);
-		FD_SET(sremote, &fds);
-		int nfds = ((slocal > sremote) ? slocal : sremote);
-		// forwarding sockets
-		Forwarder *f = fwd;
-		while (f) {
-			FD_SET(f->sock, &fds);
-			nfds = (f->sock > nfds) ? f->sock : nfds;
-			f = f->next;
-		}
-		// communication with the frontend process
-		FD_SET(arg_fd, &fds);
-		nfds = (arg_fd > nfds) ? arg_fd : nfds;
-		nfds += 1;
-
-		errno = 0;
-		int rv = select(nfds, &fds, NULL, NULL, &t);
-		if (rv == -1) {
-			if (errno == EINTR) {
-				// select() man page reads:
-				// "... the sets and  timeout become undefined, so
-				// do not rely on their contents after an error. "
-				t.tv_sec = 1;
-				t.tv_usec = 0;
-				continue;
-			}
-			errExit("select");
-		}
-
-		//***********************************************
-		// one second timeout
-		//***********************************************
-		else if (rv == 0) {
-			time_t ts = time(NULL);
-			if (ts - timestamp > OUT_OF_SLEEP) {
-				rlogprintf("Suspend detected, restarting SSL connection\n");
-				cache_init();
-				ssl_close();
-				ssl_open();
-			}
-			timestamp = ts;
-
-			// processing stats
-			if (--console_printout_cnt <= 0) {
-				if (stats.changed) {
-					if (stats.ssl_pkts_cnt == 0)
-						stats.ssl_pkts_cnt = 1;
-					rlogprintf("Stats: rx %u, dropped %u, fallback %u, cached %u, fwd %u, %.02lf\n",
-						   stats.rx, stats.drop, stats.fallback, stats.cached, stats.fwd,
-						   stats.ssl_pkts_timetrace / stats.ssl_pkts_cnt);
-					stats.changed = 0;
-					memset(&stats, 0, sizeof(stats));
-				}
-				console_printout_cnt = CONSOLE_PRINTOUT_TIMER;
-			}
-
-			// reopen SSL connection
-			if (ssl_state == SSL_CLOSED) {
-				rlogprintf("SSL conn was closed, reopening now\n");
-				if (--ssl_reopen_cnt <= 0) {
-					ssl_open();
-					ssl_reopen_cnt = SSL_REOPEN_TIMER;
-				}
-			}
-
-			// ssl keepalive:
-			// if any incoming data, probably is the session going down - force a keepalive
-			if (ssl_status_check())
-				ssl_keepalive_cnt = 0;
-			if (--ssl_keepalive_cnt <= 0)  {
-				ssl_keepalive();
-				ssl_keepalive_cnt = ssl_keepalive_timer;
-			}
-
-			// send resolver keepalive
-			if (--resolver_keepalive_cnt <= 0)  {
-				rlogprintf("resolver keepalive\n");
-				resolver_keepalive_cnt = RESOLVER_KEEPALIVE_TIMER;
-			}
-
-			// check frontend keepalive
-			if (++frontend_keepalive_cnt >= FRONTEND_KEEPALIVE_SHUTDOWN) {
-				fprintf(stderr, "Error: resolver process going down, frontend keepalive failed\n");
-				exit(1);
-			}
-			
-			// database cleanup
-			dnsdb_timeout();
-			cache_timeout();
-			t.tv_sec = 1;
-			t.tv_usec = 0;
+		// the DoH requests received during the last pass go out together
+		ssl_timeout();
+		ssl_send_queued();
+		if (!event_wait(NULL))
 			continue;
-		}
 
 		//***********************************************
-		// frontend keepalive
+		// one second timer
 		//***********************************************
-		if (FD_ISSET(arg_fd, &fds)) {
-			int sz = read(arg_fd, buf, MAXBUF);
-			(void) sz; // todo: error recovery
-			frontend_keepalive_cnt = 0;
-			continue;
+		time_t ts = time(NULL);
+		if (ts - timestamp > OUT_OF_SLEEP) {
+			rlogprintf("Suspend detected, restarting SSL connection\n");
+			cache_init();
+			ssl_close();
+			ssl_open();
 		}
-
-		//***********************************************
-		// data coming from remote DNS fallback server
-		//***********************************************
-		if (FD_ISSET(sremote, &fds)) {
-			struct sockaddr_in remote;
-			memset(&remote, 0, sizeof(remote));
-			socklen_t remote_len = sizeof(struct sockaddr_in);
-			ssize_t len = recvfrom(sremote, buf, MAXBUF, 0, (struct sockaddr *) &remote, &remote_len);
-			if (len == -1) // todo: parse errno - EINTR
-				errExit("recvfrom");
-			if(arg_debug)
-				printf("rx remote packet len %ld\n", len);
-
-			// check remote ip address - RFC 5452 (todo - more matches)
-			if (remote.sin_addr.s_addr != addr_fallback.sin_addr.s_addr) {
-				rlogprintf("Error: wrong IP address for fallback response: %d.%d.%d.%d\n",
-					   PRINT_IP(ntohs(remote.sin_addr.s_addr)));
-				continue;
-			}
-			if (remote.sin_port != addr_fallback.sin_port) {
-				rlogprintf("Error: wrong UDP port for fallback response: %d\n",
-					   PRINT_IP(ntohs(remote.sin_port)));
-				continue;
-			}
-
-			struct sockaddr_in *addr_client = dnsdb_retrieve(buf);
-			if (!addr_client) {
-				rlogprintf("Warning: DNS over UDP request timeout\n");
-				continue;
+		timestamp = ts;
+
+		// processing stats
+		if (--console_printout_cnt <= 0) {
+			if (stats.changed) {
+				if (stats.ssl_pkts_cnt == 0)
+					stats.ssl_pkts_cnt = 1;
+				rlogprintf("Stats: rx %u, dropped %u, fallback %u, cached %u, fwd %u, hedged %u, coalesced %u, "
+					   "miss %u, admitted %u, rejected %u, evicted %u, %.02lf\n",
+					   stats.rx, stats.drop, stats.fallback, stats.cached, stats.fwd, stats.hedge, stats.coalesced,
+					   stats.cache_miss, stats.cache_admit, stats.cache_reject, stats.cache_evict,
+					   stats.ssl_pkts_timetrace / stats.ssl_pkts_cnt);
+				stats.changed = 0;
+				memset(&stats, 0, sizeof(stats));
 			}
-			socklen_t addr_client_len = sizeof(struct sockaddr_in);
-
-			// send the data to the local client
-			errno = 0;
-			len = sendto(slocal, buf, len, 0, (struct sockaddr *) addr_client, addr_client_len);
-			if(arg_debug)
-				printf("len %ld, errno %d\n", len, errno);
-			if (len == -1) // todo: parse errno - EAGAIN
-				errExit("sendto");
-			continue;
+			console_printout_cnt = CONSOLE_PRINTOUT_TIMER;
 		}
 
-
-		//***********************************************
-		// data coming from the local network  - Respond to request here
-		//***********************************************
-		if (FD_ISSET(slocal, &fds)) {
-			struct sockaddr_in addr_client;
-			socklen_t addr_client_len = sizeof(struct sockaddr_in);
-
-			ssize_t len = recvfrom(slocal, buf, MAXBUF, 0, (struct sockaddr *) &addr_client, &addr_client_len);
-			if (len == -1) // todo: parse errno - EAGAIN
-				errExit("recvfrom");
-			if(arg_debug)
-				printf("rx local packet len %ld\n", len);
-			stats.rx++;
-			stats.changed = 1;
-
-			// filter incoming requests
-			char* domain = NULL;
-			DnsDestination dest;
-			
-			/*
-			Custom Start
-			*/
-			
-			if (ssl_state == SSL_OPEN){
-				printf("Closing SSL\n");
-				ssl_close();
-			}
-			/*
-			Custom End
-			*/
-
-			uint8_t *r = dns_parser_domain(buf, &len, &dest, &domain);
-			rlogprintf(" ----------------------------\n - Received request for domain %s\n ----------------------------\n", domain);
-
-			assert(dest < DEST_MAX);
-			if (dest == DEST_DROP) {
-				stats.drop++;
-				continue;
-			}
-
-			else if (dest == DEST_LOCAL) {
-				assert(r);
-				
-				printf("(%d) Cache DNS data:\n", arg_id);
-				print_mem((uint8_t *) buf, 150);
-
-				// send the loopback response
-				len = sendto(slocal, r, len, 0, (struct sockaddr *) &addr_client, addr_client_len);
-				
-				if(arg_debug)
-					printf("len %ld, errno %d\n", len, errno);
-				if (len == -1) // todo: parse errno - EAGAIN
-					errExit("sendto");
-
-				continue;
-			}
-
-			else if (dest == DEST_FORWARDING) {
-				assert(fwd_active);
-
-				errno = 0;
-				len = sendto(fwd_active->sock, buf, len, 0, (struct sockaddr *) &fwd_active->saddr, fwd_active->slen);
-				if(arg_debug)
-					printf("len %ld, errno %d\n", len, errno);
-				if (len == -1) // todo: parse errno - EAGAIN
-					errExit("sendto");
-
-				// store the incoming request in the database
-				dnsdb_store(buf, &addr_client);
-				fwd_active = NULL;
-				continue;
+		// reopen the SSL connections that went down
+		if (ssl_closed()) {
+			if (--ssl_reopen_cnt <= 0) {
+				rlogprintf("SSL conn was closed, reopening now\n");
+				ssl_open();
+				ssl_reopen_cnt = SSL_REOPEN_TIMER;
 			}
+		}
 
-			// attempt to send the data over SSL; the request is not stored in the database
-			assert(dest == DEST_SSL);
-
-
-
-			int ssl_len;
-			timetrace_start();
-
-			ssl_len = ssl_dns_pool(domain, buf, len);
-			//ssl_len = ssl_dns(buf, len);
+		// ssl keepalive
+		ssl_keepalive_timer();
 
-			// a HTTP error from SSL, with no DNS data comming back
-			if (ssl_state == SSL_OPEN && ssl_len == 0){
-				continue;	// drop the packet
-			}
-			// good packet from SSL
-			else if (ssl_state == SSL_OPEN && ssl_len > 0) {
-				stats.ssl_pkts_timetrace += timetrace_end();
-				stats.ssl_pkts_cnt++;
-				dns_over_udp = 0;
-
-				// we got a response, send the data back to the client
-				len = ssl_len;
-				errno = 0;
-				len = sendto(slocal, buf, len, 0, (struct sockaddr *) &addr_client, addr_client_len);
-				if(arg_debug)
-					printf("len %ld, errno %d\n", len, errno);
-				if (len == -1) // todo: parse errno - EAGAIN
-					errExit("sendto");
-				else
-					ssl_keepalive_cnt = ssl_keepalive_timer;
-			}
-			// send the data to the remote fallback server; store the request in the database
-			else {
-				stats.fallback++;
-				stats.changed = 1;
-				if (!dns_over_udp)
-					rlogprintf("Warning: sending requests in clear\n");
-				dns_over_udp = 1;
-				errno = 0;
-				len = sendto(sremote, buf, len, 0, (struct sockaddr *) &addr_fallback, addr_fallback_len);
-				if(arg_debug)
-					printf("len %ld, errno %d\n", len, errno);
-				if (len == -1) // todo: parse errno - EAGAIN
-					errExit("sendto");
-
-				// store the incoming request in the database
-				dnsdb_store(buf, &addr_client);
-			}
-			continue;
+		// send resolver keepalive
+		if (--resolver_keepalive_cnt <= 0)  {
+			rlogprintf("resolver keepalive\n");
+			resolver_keepalive_cnt = RESOLVER_KEEPALIVE_TIMER;
 		}
 
-		//***********************************************
-		// data coming from a forwarding DNS server
-		//***********************************************
-		if (fwd) {
-			Forwarder *f = fwd;
-			while (f) {
-				if (FD_ISSET(f->sock, &fds)) {
-					struct sockaddr_in remote;
-					memset(&remote, 0, sizeof(remote));
-					socklen_t remote_len = sizeof(struct sockaddr_in);
-					ssize_t len = recvfrom(f->sock, buf, MAXBUF, 0, (struct sockaddr *) &remote, &remote_len);
-					if (len == -1) // todo: parse errno - EINTR
-						errExit("recvfrom");
-					if(arg_debug)
-						printf("rx remote packet len %ld\n", len);
-
-					// check remote ip address
-					if (remote.sin_addr.s_addr != f->saddr.sin_addr.s_addr) {
-						rlogprintf("Warning: wrong IP address for fwd response: %d.%d.%d.%d\n",
-							   PRINT_IP(ntohl(remote.sin_addr.s_addr)));
-						continue;
-					}
-
-					struct sockaddr_in *addr_client = dnsdb_retrieve(buf);
-					if (!addr_client) {
-						rlogprintf("Warning: fwd DNS over UDP request timeout\n");
-						continue;
-					}
-					socklen_t addr_client_len = sizeof(struct sockaddr_in);
-
-					// send the data to the local client
-					errno = 0;
-					len = sendto(slocal, buf, len, 0, (struct sockaddr *) addr_client, addr_client_len);
-					if(arg_debug)
-						printf("len %ld, errno %d\n", len, errno);
-					if (len == -1) // todo: parse errno - EAGAIN
-						errExit("sendto");
-				}
-
-				f = f->next;
-			}
-			continue;
+		// check frontend keepalive
+		if (++frontend_keepalive_cnt >= FRONTEND_KEEPALIVE_SHUTDOWN) {
+			fprintf(stderr, "Error: resolver process going down, frontend keepalive failed\n");
+			exit(1);
 		}
 
+		// cache and database expiry
+		wheel_tick();
 	}
 }
-
@@ -18,8 +18,10 @@
 */
 #include "fdns.h"
 #include "timetrace.h"
+#include "h2.h"
 #include <sys/wait.h>
 #include <time.h>
+#include <poll.h>
 
 int server_print_zone = 0;
 int server_print_servers = 0;
@@ -33,8 +35,7 @@ static DnsServer *spool = NULL;
 static char *push_request_tail =
 	"accept: application/dns-message\r\n" \
 	"content-type: application/dns-message\r\n" \
-	"content-length: %d\r\n" \
-	"\r\n";
+	"content-length: ";
 
 static inline void print_server(DnsServer *s) {
 	assert(s);
@@ -80,6 +81,17 @@ static void set_zone(void) {
 }
 
 // returns NULL for end of list
+// timeout in milliseconds; current is the value already set for this server, 0 if none
+static int server_timeout(const char *str, int current, const char *fname, int linecnt) {
+	int val;
+	if (current || sscanf(str, "%d", &val) != 1 || val < TIMEOUT_MIN || val > TIMEOUT_MAX) {
+		fprintf(stderr, "Error: file %s, line %d, invalid timeout, use a value between %d and %d ms\n",
+			fname, linecnt, TIMEOUT_MIN, TIMEOUT_MAX);
+		exit(1);
+	}
+	return val;
+}
+
 static DnsServer *read_one_server(FILE *fp, int *linecnt, const char *fname) {
 	assert(fp);
 	assert(linecnt);
@@ -89,6 +101,7 @@ static DnsServer *read_one_server(FILE *fp, int *linecnt, const char *fname) {
 	if (!s)
 		errExit("malloc");
 	memset(s, 0, sizeof(DnsServer));
+	s->h2_streams = -1;
 
 	char buf[4096];
 	buf[0] = '\0';
@@ -160,17 +173,28 @@ static DnsServer *read_one_server(FILE *fp, int *linecnt, const char *fname) {
 				errExit("strdup");
 			found = 1;
 
-			// build the DNS/HTTP request
+			// build the DNS/HTTP request; DoT servers have no URL path
 			char *str = strchr(s->host, '/');
-			if (!str) {
-				free(s);
-				fprintf(stderr, "Error: file %s, line %d, invalid host\n", fname, *linecnt);
-				exit(1);
-			}
+			if (!str)
+				continue;
 			*str++ = '\0';
-			if (asprintf(&s->request, "POST /%s HTTP/1.1\r\nHost: %s\r\n%s", str, s->host, push_request_tail) == -1)
+			if (asprintf(&s->path, "/%s", str) == -1)
+				errExit("asprintf");
+			// the header is built only once, the content-length value is added for each query
+			s->request_len = asprintf(&s->request, "POST %s HTTP/1.1\r\nHost: %s\r\n%s", s->path, s->host, push_request_tail);
+			if (s->request_len == -1)
 				errExit("asprintf");
 		}
+		else if (strncmp(buf, "transport: ", 11) == 0) {
+			if (s->dot)
+				goto errout;
+			if (strcmp(buf + 11, "dot") == 0)
+				s->dot = 1;
+			else if (strcmp(buf + 11, "doh") != 0) {
+				fprintf(stderr, "Error: file %s, line %d, wrong transport setting, use doh or dot\n", fname, *linecnt);
+				exit(1);
+			}
+		}
 		else if (strncmp(buf, "sni: ", 5) == 0) {
 			if (s->sni)
 				goto errout;
@@ -183,6 +207,33 @@ static DnsServer *read_one_server(FILE *fp, int *linecnt, const char *fname) {
 				exit(1);
 			}
 		}
+		else if (strncmp(buf, "pipelining: ", 12) == 0) {
+			if (s->pipelining)
+				goto errout;
+			if (strcmp(buf + 12, "yes") == 0)
+				s->pipelining = 1;
+			else if (strcmp(buf + 12, "no") == 0)
+				s->pipelining = 0;
+			else {
+				fprintf(stderr, "Error: file %s, line %d, wrong pipelining setting\n", fname, *linecnt);
+				exit(1);
+			}
+		}
+		else if (strncmp(buf, "connect-timeout: ", 17) == 0)
+			s->connect_timeout = server_timeout(buf + 17, s->connect_timeout, fname, *linecnt);
+		else if (strncmp(buf, "write-timeout: ", 15) == 0)
+			s->write_timeout = server_timeout(buf + 15, s->write_timeout, fname, *linecnt);
+		else if (strncmp(buf, "read-timeout: ", 14) == 0)
+			s->read_timeout = server_timeout(buf + 14, s->read_timeout, fname, *linecnt);
+		else if (strncmp(buf, "streams: ", 9) == 0) {
+			if (s->h2_streams != -1)
+				goto errout;
+			if (sscanf(buf + 9, "%d", &s->h2_streams) != 1 || s->h2_streams < 0 || s->h2_streams > H2_STREAMS_MAX) {
+				fprintf(stderr, "Error: file %s, line %d, invalid number of streams, the maximum is %d\n",
+					fname, *linecnt, H2_STREAMS_MAX);
+				exit(1);
+			}
+		}
 		else if (strncmp(buf, "keepalive: ", 11) == 0) {
 			if (s->ssl_keepalive)
 				goto errout;
@@ -192,10 +243,19 @@ static DnsServer *read_one_server(FILE *fp, int *linecnt, const char *fname) {
 			}
 
 			// check server data
-			if (!s->name || !s->website || !s->zone || !s->tags || !s->address || !s->host || !s->request) {
+			if (!s->name || !s->website || !s->zone || !s->tags || !s->address || !s->host) {
 				fprintf(stderr, "Error: file %s, line %d, one of the server fields is missing\n", fname, *linecnt);
 				exit(1);
 			}
+			if (!s->dot && !s->request) {
+				fprintf(stderr, "Error: file %s, line %d, invalid host, URL path missing\n", fname, *linecnt);
+				exit(1);
+			}
+
+			if (s->dot)
+				s->h2_streams = 0;	// no HTTP
+			else if (s->h2_streams == -1)
+				s->h2_streams = H2_STREAMS_DEFAULT;
 
 			// add host to filter
 			if (!arg_allow_local_doh)
@@ -264,7 +324,7 @@ int test_server(const char *server_name)  {
 		fflush(0);
 
 		timetrace_start();
-		ssl_open();
+		ssl_open_server(scurrent);
 		if (ssl_state == SSL_CLOSED) {
 			fprintf(stderr, "\t[Test] Error: cannot open SSL connection to server %s\n", arg_server);
 			fflush(0);
@@ -329,6 +389,443 @@ int test_server(const char *server_name)  {
 	return 0;
 }
 
+// domains used by --benchmark if no file is provided
+static const char *bench_default[] = {
+	"google.com", "youtube.com", "facebook.com", "wikipedia.org", "amazon.com",
+	"twitter.com", "instagram.com", "linkedin.com", "reddit.com", "netflix.com",
+	NULL
+};
+
+typedef struct bench_t {
+	DnsServer *srv;
+	pid_t pid;	// test process, 0 if not running
+	time_t start;
+	double connect;	// connection setup time in ms, -1 if failed
+	double p50;	// response time percentiles in ms
+	double p95;
+	double p99;
+	int ok;	// queries answered
+	int total;	// queries sent
+} Bench;
+
+static int bench_cmp_ms(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+// ranking: the servers answering the queries first, by p95 and p50
+static int bench_cmp(const void *a, const void *b) {
+	const Bench *x = a;
+	const Bench *y = b;
+	if ((x->ok == 0) != (y->ok == 0))
+		return (x->ok == 0) ? 1 : -1;
+	if (x->p95 != y->p95)
+		return (x->p95 > y->p95) ? 1 : -1;
+	return (x->p50 > y->p50) - (x->p50 < y->p50);
+}
+
+static int bench_load(const char *fname, const char **domains) {
+	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+		fprintf(stderr, "Error: cannot open %s\n", fname);
+		exit(1);
+	}
+
+	char buf[MAXBUF];
+	int cnt = 0;
+	while (fgets(buf, MAXBUF, fp) && cnt < BENCH_DOMAINS_MAX) {
+		char *ptr = buf;
+		while (*ptr == ' ' || *ptr == '\t')
+			ptr++;
+		char *end = ptr + strcspn(ptr, " \t\r\n");
+		*end = '\0';
+		if (*ptr == '\0' || *ptr == '#')
+			continue;
+		domains[cnt] = strdup(ptr);
+		if (!domains[cnt])
+			errExit("strdup");
+		cnt++;
+	}
+	fclose(fp);
+
+	if (cnt == 0) {
+		fprintf(stderr, "Error: no domains found in %s\n", fname);
+		exit(1);
+	}
+	return cnt;
+}
+
+// test one server in a child process, total queries over the domain list; the result is sent back
+// as a text line on fd: index, connection setup time, p50, p95, p99, answered queries, total queries
+static void bench_child(int index, DnsServer *s, const char **domains, int cnt, int total, int fd) {
+	log_disable();
+	ssl_init();
+
+	double ms[BENCH_DOMAINS_MAX * BENCH_ROUNDS];
+	int ok = 0;
+	if (total > BENCH_DOMAINS_MAX * BENCH_ROUNDS)
+		total = BENCH_DOMAINS_MAX * BENCH_ROUNDS;
+	double connect = ssl_test_open(s);
+	if (connect >= 0) {
+		// give up on a server failing the queries, as the circuit breaker would do
+		int failures = 0;
+		int i;
+		for (i = 0; i < total && failures < BREAKER_FAILURES; i++) {
+			double t = ssl_test_query(s, domains[i % cnt]);
+			if (t >= 0) {
+				ms[ok++] = t;
+				failures = 0;
+			}
+			else
+				failures++;
+		}
+	}
+	qsort(ms, ok, sizeof(double), bench_cmp_ms);
+
+	// nearest-rank percentiles
+	double p50 = (ok) ? ms[(ok * 50 + 99) / 100 - 1] : -1;
+	double p95 = (ok) ? ms[(ok * 95 + 99) / 100 - 1] : -1;
+	double p99 = (ok) ? ms[(ok * 99 + 99) / 100 - 1] : -1;
+	char buf[128];
+	int len = snprintf(buf, sizeof(buf), "%d %.2f %.2f %.2f %.2f %d %d\n",
+			   index, connect, p50, p95, p99, ok, total);
+	if (write(fd, buf, len) != len)
+		exit(1);
+	exit(0);
+}
+
+// process the result lines coming from the test processes
+static void bench_read(int fd, Bench *b, int cnt) {
+	static char buf[4096];
+	static int len = 0;
+	ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+	if (n <= 0)
+		return;
+	len += n;
+	buf[len] = '\0';
+
+	char *ptr = buf;
+	char *end;
+	while ((end = strchr(ptr, '\n')) != NULL) {
+		*end = '\0';
+		int index;
+		Bench r;
+		if (sscanf(ptr, "%d %lf %lf %lf %lf %d %d", &index, &r.connect, &r.p50, &r.p95, &r.p99,
+			   &r.ok, &r.total) == 7 && index >= 0 && index < cnt) {
+			b[index].connect = r.connect;
+			b[index].p50 = r.p50;
+			b[index].p95 = r.p95;
+			b[index].p99 = r.p99;
+			b[index].ok = r.ok;
+			b[index].total = r.total;
+		}
+		ptr = end + 1;
+	}
+	len -= ptr - buf;
+	memmove(buf, ptr, len);
+}
+
+// test the servers in b[] in parallel, queries on each server; the results are stored in b[]
+static void bench_run(Bench *b, int cnt, const char **domains, int dcnt, int queries, int parallel,
+		      int timeout, int verbose) {
+	int i;
+	for (i = 0; i < cnt; i++)
+		b[i].connect = -1;
+
+	int fd[2];
+	if (pipe(fd) == -1)
+		errExit("pipe");
+	fflush(0);
+
+	int next = 0;
+	int running = 0;
+	int finished = 0;
+	while (finished < cnt) {
+		while (running < parallel && next < cnt) {
+			pid_t child = fork();
+			if (child == -1)
+				errExit("fork");
+			if (child == 0) {
+				close(fd[0]);
+				bench_child(next, b[next].srv, domains, dcnt, queries, fd[1]);
+			}
+			b[next].pid = child;
+			b[next].start = time(NULL);
+			running++;
+			next++;
+		}
+
+		struct pollfd pfd = { .fd = fd[0], .events = POLLIN };
+		if (poll(&pfd, 1, 1000) > 0)
+			bench_read(fd[0], b, cnt);
+
+		pid_t pid;
+		int status;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < cnt; i++) {
+				if (b[i].pid == pid) {
+					b[i].pid = 0;
+					running--;
+					finished++;
+					if (verbose)
+						fprintf(stderr, "\t%s done, %d/%d\n", b[i].srv->name, finished, cnt);
+					break;
+				}
+			}
+		}
+
+		time_t now = time(NULL);
+		for (i = 0; i < cnt; i++) {
+			if (b[i].pid && now - b[i].start > timeout)
+				kill(b[i].pid, SIGKILL);
+		}
+	}
+
+	// the last results
+	struct pollfd pfd = { .fd = fd[0], .events = POLLIN };
+	while (poll(&pfd, 1, 0) > 0)
+		bench_read(fd[0], b, cnt);
+	close(fd[0]);
+	close(fd[1]);
+
+	qsort(b, cnt, sizeof(Bench), bench_cmp);
+}
+
+// test many servers at the same time, and print a table ranked by the response time;
+// the table goes to stdout, tab separated, the progress messages go to stderr
+void server_benchmark(const char *tag, const char *domains_file) {
+	const char *domains[BENCH_DOMAINS_MAX];
+	int dcnt;
+	if (domains_file)
+		dcnt = bench_load(domains_file, domains);
+	else {
+		for (dcnt = 0; bench_default[dcnt]; dcnt++)
+			domains[dcnt] = bench_default[dcnt];
+	}
+
+	server_list(tag);
+	int cnt = 0;
+	DnsServer *s;
+	for (s = slist; s; s = s->next)
+		cnt += (s->active) ? 1 : 0;
+	if (cnt == 0) {
+		fprintf(stderr, "Error: no DoH servers found\n");
+		exit(1);
+	}
+
+	Bench *b = malloc(cnt * sizeof(Bench));
+	if (!b)
+		errExit("malloc");
+	memset(b, 0, cnt * sizeof(Bench));
+	int i = 0;
+	for (s = slist; s; s = s->next) {
+		if (s->active)
+			b[i++].srv = s;
+	}
+
+	fprintf(stderr, "Benchmarking %d servers, %d queries each, %d servers at a time\n",
+		cnt, dcnt * BENCH_ROUNDS, BENCH_PARALLEL);
+	bench_run(b, cnt, domains, dcnt, dcnt * BENCH_ROUNDS, BENCH_PARALLEL, BENCH_TIMEOUT, 1);
+
+	printf("# rank\tserver\tconnect_ms\tp50_ms\tp95_ms\tp99_ms\tanswered\tqueries\n");
+	for (i = 0; i < cnt; i++) {
+		if (b[i].ok)
+			printf("%d\t%s\t%.2f\t%.2f\t%.2f\t%.2f\t%d\t%d\n", i + 1, b[i].srv->name,
+			       b[i].connect, b[i].p50, b[i].p95, b[i].p99, b[i].ok, b[i].total);
+		else if (b[i].connect >= 0)
+			printf("%d\t%s\t%.2f\t-\t-\t-\t0\t%d\n", i + 1, b[i].srv->name, b[i].connect, b[i].total);
+		else
+			printf("%d\t%s\t-\t-\t-\t-\t0\t%d\n", i + 1, b[i].srv->name, dcnt * BENCH_ROUNDS);
+	}
+	fflush(0);
+	free(b);
+}
+
+// servers ranked at startup, the fastest first
+static DnsServer *rank[PROBE_POOL];
+static int rank_cnt = 0;
+
+// load the ranking saved in PATH_RUN_RANKING, one "name connect_ms p95_ms" line for each server;
+// the frontend removes a ranking older than RANKING_TTL or older than the server list before probing
+// the servers again, the resolvers always use the ranking of the frontend, or the zone if there is none
+static void ranking_load(void) {
+	struct stat st;
+	if (stat(PATH_RUN_RANKING, &st) == -1)
+		return;
+	if (arg_id == -1) {
+		struct stat lst;
+		if (time(NULL) - st.st_mtime > RANKING_TTL ||
+		    (stat(PATH_ETC_SERVER_LIST, &lst) == 0 && lst.st_mtime > st.st_mtime)) {
+			unlink(PATH_RUN_RANKING);
+			return;
+		}
+	}
+
+	FILE *fp = fopen(PATH_RUN_RANKING, "r");
+	if (!fp)
+		return;
+	char buf[MAXBUF];
+	while (fgets(buf, MAXBUF, fp) && rank_cnt < PROBE_POOL) {
+		char *ptr = strtok(buf, " \t\r\n");
+		if (!ptr || *ptr == '#')
+			continue;
+		// the server could be gone from the list
+		DnsServer *s;
+		for (s = slist; s; s = s->next) {
+			if (strcmp(s->name, ptr) == 0) {
+				rank[rank_cnt++] = s;
+				break;
+			}
+		}
+	}
+	fclose(fp);
+}
+
+// a candidate server is one of the servers picked by the geographical zones, serving the current zone
+static int ranking_candidate(DnsServer *s) {
+	if (!strstr(s->tags, "Europe") && !strstr(s->tags, "Asia-Pacific") &&
+	    !strstr(s->tags, "Americas-East") && !strstr(s->tags, "Americas-West"))
+		return 0;
+	if (strcmp(fdns_zone, "unknown") == 0 || strcmp(fdns_zone, "any") == 0)
+		return 1;
+	return strstr(s->zone, fdns_zone) != NULL;
+}
+
+// probe at most PROBE_CANDIDATES candidate servers in parallel, and save the ranking
+// in PATH_RUN_RANKING; the servers are picked at random, every start probes a different set
+static void ranking_probe(void) {
+	Bench *b = malloc(PROBE_CANDIDATES * sizeof(Bench));
+	if (!b)
+		errExit("malloc");
+	memset(b, 0, PROBE_CANDIDATES * sizeof(Bench));
+
+	// reservoir sampling
+	int found = 0;
+	DnsServer *s;
+	for (s = slist; s; s = s->next) {
+		if (!ranking_candidate(s))
+			continue;
+		int j = (found < PROBE_CANDIDATES) ? found : rand() % (found + 1);
+		if (j < PROBE_CANDIDATES)
+			b[j].srv = s;
+		found++;
+	}
+	int cnt = (found < PROBE_CANDIDATES) ? found : PROBE_CANDIDATES;
+	if (cnt == 0) {
+		free(b);
+		return;
+	}
+
+	logprintf("probing %d DoH servers in zone %s\n", cnt, fdns_zone);
+	bench_run(b, cnt, bench_default, PROBE_QUERIES, PROBE_QUERIES, PROBE_PARALLEL, PROBE_TIMEOUT, 0);
+
+	// only the servers answering all the queries are ranked
+	int i;
+	for (i = 0; i < cnt && rank_cnt < PROBE_POOL; i++) {
+		if (b[i].ok == PROBE_QUERIES) {
+			rank[rank_cnt++] = b[i].srv;
+			logprintf("\t%s, connect %.2f ms, p95 %.2f ms\n", b[i].srv->name, b[i].connect, b[i].p95);
+		}
+	}
+
+	if (rank_cnt) {
+		struct stat st;
+		if (stat(PATH_RUN_FDNS, &st) == -1 && mkdir(PATH_RUN_FDNS, 0755) == -1)
+			errExit("mkdir");
+		// write a new file and rename it, a resolver could be reading the old one
+		char *tmp;
+		if (asprintf(&tmp, "%s.tmp", PATH_RUN_RANKING) == -1)
+			errExit("asprintf");
+		FILE *fp = fopen(tmp, "w");
+		if (fp) {
+			fprintf(fp, "# server connect_ms p95_ms\n");
+			for (i = 0; i < cnt; i++) {
+				if (b[i].ok == PROBE_QUERIES)
+					fprintf(fp, "%s %.2f %.2f\n", b[i].srv->name, b[i].connect, b[i].p95);
+			}
+			fclose(fp);
+			if (rename(tmp, PATH_RUN_RANKING) == -1)
+				unlink(tmp);
+		}
+		free(tmp);
+	}
+	else
+		logprintf("no DoH server answered the probes, using the servers in zone %s\n", fdns_zone);
+	free(b);
+}
+
+// build the ranking: load it from PATH_RUN_RANKING, or probe the servers in the frontend;
+// returns the number of servers ranked, 0 if the servers should be picked using the zone
+static int ranking_init(void) {
+	if (rank_cnt)
+		return rank_cnt;
+	ranking_load();
+	if (rank_cnt == 0 && arg_id == -1)
+		ranking_probe();
+	return rank_cnt;
+}
+
+// copy the active servers in the resolver pool
+static void pool_init(int cnt) {
+	assert(cnt);
+	spool = malloc(cnt * sizeof(DnsServer));
+	if (!spool)
+		errExit("malloc");
+
+	DnsServer *s = slist;
+	spool_len = 0;
+	while (s) {
+		if (s->active) { // need to copy it to ensure it is on all threads
+			memcpy(&spool[spool_len], s, sizeof(DnsServer));
+			if (arg_debug)
+				printf("%d: %s\n", spool_len, spool[spool_len].name);
+			spool_len++;
+		}
+		s = s->next;
+	}
+	assert(spool_len == cnt);
+}
+
+// load the resolver pool using the current zone as a tag
+static void pool_load(void) {
+	if (spool)
+		return;
+
+	load_list();
+	if (!slist) {
+		fprintf(stderr, "Error: the server list %s is empty", PATH_ETC_SERVER_LIST);
+		exit(1);
+	}
+	// update arg_server
+	assert(fdns_zone);
+	arg_server = strdup(fdns_zone);
+	if (!arg_server)
+		errExit("strdup");
+	// arg_server is in mallocated memory
+
+	// initialize s->active
+	server_list(arg_server);
+	assert(slist);
+
+	int cnt = 0;
+	DnsServer *s = slist;
+	while (s) {
+		if (s->active)
+			cnt++;
+		s = s->next;
+	}
+	rlogprintf("Finished loading spool with %s - contains %d resolvers\n", arg_server, cnt);
+	if (cnt == 0) {
+		rlogprintf("Connect failed for %s\n", arg_server);
+		fprintf(stderr, "Error: cannot connect to server %s\n", arg_server);
+		exit(1);
+	}
+
+	rlogprintf("[1] Reloading resolver pool\n");
+	pool_init(cnt);
+}
+
 //**************************************************************************
 // public interface
 //**************************************************************************
@@ -424,6 +921,23 @@ DnsServer *server_get(void) {
 		exit(1);
 	}
 
+	// no server requested: the resolver pool is built from the fastest servers
+	if (arg_server == NULL && arg_zone == NULL && ranking_init()) {
+		int i;
+		for (i = 0; i < rank_cnt; i++)
+			rank[i]->active = 1;
+		if (!spool) {
+			printf("[0] Reloading resolver pool\n");
+			pool_init(rank_cnt);
+		}
+		printf("poolsize %d\n", spool_len);
+		scurrent = rank[0];
+		arg_server = strdup(scurrent->name);
+		if (!arg_server)
+			errExit("strdup");
+		return scurrent;
+	}
+
 	// update arg_server
 	if (arg_server == NULL) {
 		assert(fdns_zone);
@@ -451,17 +965,7 @@ DnsServer *server_get(void) {
 
 	if (!spool) {
 		printf("[0] Reloading resolver pool\n");
-		spool = (DnsServer*)malloc(cnt*sizeof(DnsServer));
-		s = slist;
-		spool_len=0;
-		for (int ind=0; s; s=s->next){
-			if (s->active){ 
-				memcpy(&spool[ind],s,sizeof(DnsServer));
-				printf("%d: %s\n", ind, spool[ind].name);
-				ind++;
-				spool_len++;
-			}
-		}
+		pool_init(cnt);
 	}
 	printf("poolsize %d\n", spool_len);
 
@@ -516,76 +1020,274 @@ errout:
 unsigned long djb2(const char *str) {
 	unsigned long hash = 5481;
 	int c;
-	while (c = *str++){
+	while ((c = *str++) != 0) {
 		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
 	}
 	return hash;
 }
 
+// the servers with the circuit breaker tripped are skipped, unless all of them are tripped
+static int sched_all = 0;
+static inline int sched_in(DnsServer *s) {
+	return sched_all || s->breaker == BREAKER_CLOSED;
+}
+
+// random server
+static int sched_random(void) {
+	int cnt = 0;
+	int i;
+	for (i = 0; i < spool_len; i++)
+		cnt += sched_in(&spool[i]);
+	int n = rand() % cnt;
+	for (i = 0; i < spool_len; i++) {
+		if (sched_in(&spool[i]) && n-- == 0)
+			break;
+	}
+	assert(i < spool_len);
+	return i;
+}
+
+// probe the servers without a recent sample, this also measures all the servers at startup;
+// returns the server index, -1 if there is nothing to probe
+static int sched_probe(void) {
+	double now = event_clock();
+	int i;
+	for (i = 0; i < spool_len; i++) {
+		if (sched_in(&spool[i]) && now - spool[i].probe >= SCHED_PROBE) {
+			spool[i].probe = now;
+			if (arg_debug)
+				printf("(%d) probing %s\n", arg_id, spool[i].name);
+			return i;
+		}
+	}
+	return -1;
+}
+
+// latency scheduler: the queries are spread across the fastest healthy servers, in proportion
+// to the measured performance; the rest of the servers get a probe query from time to time
+static int sched_latency(void) {
+	int i = sched_probe();
+	if (i != -1)
+		return i;
+
+	// the fastest healthy server
+	double best = 0;
+	for (i = 0; i < spool_len; i++) {
+		if (sched_in(&spool[i]) && spool[i].rtt && spool[i].err < SCHED_ERR_MAX && (best == 0 || spool[i].rtt < best))
+			best = spool[i].rtt;
+	}
+	if (best == 0) {
+		// no healthy server: use the one with the lowest error rate
+		int index = -1;
+		for (i = 0; i < spool_len; i++) {
+			if (sched_in(&spool[i]) && spool[i].rtt && (index == -1 || spool[i].err < spool[index].err))
+				index = i;
+		}
+		// nothing measured yet, the probes are still in flight
+		return (index == -1) ? sched_random() : index;
+	}
+
+	// weighted random choice
+	double total = 0;
+	for (i = 0; i < spool_len; i++) {
+		if (sched_in(&spool[i]) && spool[i].rtt && spool[i].err < SCHED_ERR_MAX && spool[i].rtt <= best * SCHED_SLOW)
+			total += (1 - spool[i].err) / spool[i].rtt;
+	}
+	double r = total * rand() / ((double) RAND_MAX + 1);
+	int index = 0;
+	for (i = 0; i < spool_len; i++) {
+		if (sched_in(&spool[i]) && spool[i].rtt && spool[i].err < SCHED_ERR_MAX && spool[i].rtt <= best * SCHED_SLOW) {
+			index = i;
+			r -= (1 - spool[i].err) / spool[i].rtt;
+			if (r < 0)
+				break;
+		}
+	}
+	return index;
+}
+
+// splitmix64 finalizer
+static inline uint64_t sched_mix(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+// hash scheduler: rendezvous (highest random weight) hashing keeps a domain on the same server,
+// and a server leaving the pool moves only its own domains; a server with more than SCHED_LOAD
+// times the average number of queries in flight is skipped, the domain goes to its next choice;
+// the client queries are never used as probes, the servers are measured in the background
+// (server_pool_sample_due)
+static int sched_hash(const char *domain) {
+	int i;
+
+	// the servers failing most of the queries are left out, unless all of them are failing
+	int healthy = 0;
+	int load = 0;
+	for (i = 0; i < spool_len; i++) {
+		if (sched_in(&spool[i]) && spool[i].err < SCHED_ERR_MAX) {
+			healthy++;
+			load += spool[i].pending;
+		}
+	}
+	int all = (healthy == 0);
+	if (all) {
+		for (i = 0; i < spool_len; i++) {
+			if (sched_in(&spool[i])) {
+				healthy++;
+				load += spool[i].pending;
+			}
+		}
+	}
+
+	// at least one server is below the average, so there is always a server under the cap
+	double avg = SCHED_LOAD * (load + 1) / healthy;
+	int cap = (int) avg;
+	if (cap < avg)
+		cap++;
+	uint64_t h = djb2(domain);
+	uint64_t best = 0;
+	int index = -1;
+	for (i = 0; i < spool_len; i++) {
+		if (!sched_in(&spool[i]) || (!all && spool[i].err >= SCHED_ERR_MAX) || spool[i].pending >= cap)
+			continue;
+		uint64_t score = sched_mix(h ^ sched_mix(djb2(spool[i].name)));
+		if (index == -1 || score > best) {
+			best = score;
+			index = i;
+		}
+	}
+	assert(index != -1);
+	return index;
+}
+
 // get a pointer to a server in the pool
 // if pool was not set, use the current zone as a tag
 DnsServer *server_pool_get(const char* domain) {
-	if (!spool){
-		load_list();
-		if (!slist) {
-			fprintf(stderr, "Error: the server list %s is empty", PATH_ETC_SERVER_LIST);
-			exit(1);
+	assert(domain);
+	pool_load();
+	assert(spool_len);
+
+	sched_all = 1;
+	int i;
+	for (i = 0; i < spool_len; i++) {
+		if (spool[i].breaker == BREAKER_CLOSED) {
+			sched_all = 0;
+			break;
 		}
-		// update arg_server
-		assert(fdns_zone);
-		arg_server = strdup(fdns_zone);
-		// arg_server is in mallocated memory
+	}
 
-		// initialize s->active
-		server_list(arg_server);
-		assert(slist);
+	int index;
+	if (arg_scheduler == SCHED_HASH)
+		index = sched_hash(domain);
+	else if (arg_scheduler == SCHED_RANDOM)
+		index = sched_random();
+	else
+		index = sched_latency();
+	if (arg_debug)
+		printf("(%d) %d servers, %s -> %s\n", arg_id, spool_len, domain, spool[index].name);
 
-		int cnt = 0;
-		DnsServer *s = slist;
-		while (s) {
-			if (s->active)
-				cnt++;
-			s = s->next;
-		}
-		rlogprintf("Finished loading spool with %s - contains %d resolvers\n", arg_server, cnt);
-		if (cnt == 0)
-			goto errout;
-
-		rlogprintf("[1] Reloading resolver pool\n");
-		spool = (DnsServer*)malloc(cnt*sizeof(DnsServer));
-		s = slist;
-		spool_len = 0;
-		for (int ind=0; s; s=s->next){
-			if (s->active){ // need to copy it to ensure it is on all threads
-				memcpy(&spool[ind],s,sizeof(DnsServer));
-				ind++;
-				spool_len++;
-			}
+	return &spool[index];
+}
+
+static int sample_cmp(const void *a, const void *b) {
+	float x = *(const float *) a;
+	float y = *(const float *) b;
+	return (x > y) - (x < y);
+}
+
+// update the scheduler data with the result of a query sent to srv: rtt is the response time
+// in ms, or -1 if the query failed
+void server_pool_result(DnsServer *srv, double rtt) {
+	assert(srv);
+	double now = event_clock();
+	if (rtt < 0) {
+		srv->err += SCHED_ALPHA * (1 - srv->err);
+
+		// circuit breaker: too many failures in a row, or the background probe failed
+		srv->failures++;
+		if ((srv->breaker == BREAKER_CLOSED && srv->failures >= BREAKER_FAILURES) ||
+		    srv->breaker == BREAKER_HALF_OPEN) {
+			if (srv->breaker == BREAKER_CLOSED)
+				rlogprintf("Warning: %s failed %d queries in a row, taking it out of the pool\n",
+					   srv->name, srv->failures);
+			srv->breaker = BREAKER_OPEN;
+			srv->breaker_time = now;
 		}
 	}
+	else {
+		srv->failures = 0;
+		if (srv->breaker != BREAKER_CLOSED) {
+			rlogprintf("%s is back in the pool\n", srv->name);
+			srv->breaker = BREAKER_CLOSED;
+			srv->breaker_time = now;
+		}
 
-	rlogprintf("%d servers - %s\n", spool_len, arg_server);
-	uint index = ((uint)djb2(domain)) % spool_len;
-	uint index = 0;
+		srv->err -= SCHED_ALPHA * srv->err;
+		srv->rtt = (srv->rtt) ? srv->rtt + SCHED_ALPHA * (rtt - srv->rtt) : rtt;
+		if (srv->rtt < 0.1)
+			srv->rtt = 0.1;	// keep it away from 0, which means not measured
 
-	char* stemp = malloc(sizeof(char)*strlen(spool[index].name));
-	
-	strcpy(stemp, spool[index].name);
-	arg_server = stemp;
-	scurrent = &spool[index];
-	
-	if (ssl_state != SSL_OPEN) {
-		int dtype = cache_get_name_type();
-		ssl_open();
-		ssl_keepalive();
-		cache_set_name(domain, dtype);
+		// p95 over the last samples, used as the hedged request threshold
+		srv->sample[srv->sample_cnt % SCHED_SAMPLES] = rtt;
+		srv->sample_cnt++;
+		if (srv->sample_cnt >= SCHED_SAMPLES / 2) {
+			int cnt = (srv->sample_cnt < SCHED_SAMPLES) ? srv->sample_cnt : SCHED_SAMPLES;
+			float sorted[SCHED_SAMPLES];
+			memcpy(sorted, srv->sample, cnt * sizeof(float));
+			qsort(sorted, cnt, sizeof(float), sample_cmp);
+			srv->p95 = sorted[(cnt * 95 + 99) / 100 - 1];
+		}
 	}
+	srv->probe = now;
+	if (arg_debug)
+		printf("(%d) %s: response time %.02f ms, p95 %.02f ms, error rate %.02f\n",
+		       arg_id, srv->name, srv->rtt, srv->p95, srv->err);
+}
 
-	return scurrent;
-errout:
-	rlogprintf("Connect failed for %s\n", arg_server);
-	fprintf(stderr, "Error: cannot connect to server %s\n", arg_server);
-	exit(1);
+// circuit breaker: after BREAKER_WAIT out of the pool the server goes half-open, and the caller
+// sends a background probe; the probe result comes back in server_pool_result()
+// returns 1 if a probe should be sent
+// hash scheduler: returns 1 if the server should get a background probe, it has no sample
+// for SCHED_PROBE
+int server_pool_sample_due(DnsServer *srv) {
+	assert(srv);
+	if (arg_scheduler != SCHED_HASH)
+		return 0;
+	double now = event_clock();
+	if (now - srv->probe < SCHED_PROBE)
+		return 0;
+	srv->probe = now;
+	return 1;
+}
+
+int server_pool_probe_due(DnsServer *srv) {
+	assert(srv);
+	if (srv->breaker == BREAKER_CLOSED)
+		return 0;
+	double now = event_clock();
+	if (now - srv->breaker_time < BREAKER_WAIT)
+		return 0;
+
+	// also when the previous probe never came back
+	srv->breaker = BREAKER_HALF_OPEN;
+	srv->breaker_time = now;
+	return 1;
+}
+
+// number of servers in the pool
+int server_pool_len(void) {
+	pool_load();
+	return spool_len;
+}
+
+DnsServer *server_pool_entry(int index) {
+	pool_load();
+	assert(index >= 0 && index < spool_len);
+	return &spool[index];
 }
 
 
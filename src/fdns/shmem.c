@@ -85,18 +85,31 @@ void shmem_store_stats(void) {
 			break;
 	char *encstatus = (i == arg_resolvers) ? "ENCRYPTED" : "NOT ENCRYPTED";
 
+	// connections open in all the resolver pools
+	int open = 0;
+	int len = 0;
+	for (i = 0; i < arg_resolvers; i++) {
+		open += pool_open[i];
+		len += pool_len[i];
+	}
+
 	snprintf(report->header, MAX_HEADER,
-		 "%s %s (SSL %.02lf ms, fallback %u), \n"
-		 "requests %u, drop %u, cache %u, fwd %u\n",
+		 "%s %s (SSL %.02lf ms, pool %d/%d, fallback %u, hedged %u), \n"
+		 "requests %u, drop %u, cache %u/%u, coalesced %u, fwd %u\n",
 
 		 srv->name,
 		 encstatus,
 		 stats.ssl_pkts_timetrace,
+		 open,
+		 len,
 		 stats.fallback,
+		 stats.hedge,
 
 		 stats.rx,
 		 stats.drop,
 		 stats.cached,
+		 stats.cache_miss,
+		 stats.coalesced,
 		 stats.fwd);
 
 
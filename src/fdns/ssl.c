@@ -19,15 +19,87 @@
 #include "fdns.h"
 #include "timetrace.h"
 #include "lint.h"
+#include "h2.h"
+#include "h1.h"
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <poll.h>
+#include <errno.h>
+#include <netinet/tcp.h>
 
 SSLState ssl_state = SSL_CLOSED;
-static BIO *bio = NULL;
 static SSL_CTX *ctx = NULL;
-static SSL *ssl = NULL;
 
+// ALPN protocol list, HTTP/2 preferred
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+
+#define SSL_PIPELINE_MAX 16	// HTTP/1.1 requests on the wire for servers marked "pipelining: yes"
+#define SSL_BUFSIZE 16384	// HTTP/1.1 buffers - a full TLS record
+#define SSL_SOCKET_BUF (64 * 1024)	// socket buffers, a burst of queries goes out in one write
+#define SSL_RETRY_MAX 1	// a query that timed out is moved to a different server only once
+#define SSL_DOT_MAX H2_STREAMS_MAX	// DoT queries in flight on a connection
+
+// connection setup steps, the setup runs in the background driven by the event loop
+typedef enum {
+	SETUP_NONE = 0,	// not in progress
+	SETUP_EARLY,	// TCP and TLS handshake, sending the early data
+	SETUP_HANDSHAKE,	// TCP and TLS handshake
+	SETUP_H2_PREFACE,	// HTTP/2: sending the connection preface
+	SETUP_H2_SETTINGS	// HTTP/2: waiting for the server SETTINGS
+} SetupStep;
+
+// connection pool: one warm SSL connection for each server in the resolver pool
+typedef struct ssl_conn_t {
+	DnsServer *srv;	// server for this connection
+	BIO *bio;
+	SSL *ssl;
+	int fd;	// socket registered with the event loop, -1 if the connection is closed
+	SSLState state;
+	int keepalive_cnt;	// seconds left until the next keepalive
+	double active;	// time of the last client query sent on the connection
+	double ping_deadline;	// HTTP/2: the PING acknowledgment is expected before this time
+	int idle;	// closed after SSL_IDLE_TIMER without client queries, reopened by the next query
+	double write_deadline;	// the output is stuck since before this time, 0 if not stuck
+	double connect_fail;	// time of the last failed connection attempt, 0 if none
+	H2Conn *h2;	// HTTP/2 connection state, NULL for HTTP/1.1 connections
+	SSL_SESSION *session;	// last TLS session ticket received from the server, used to resume the session
+	int ktls_send;	// kTLS: the kernel encrypts the outgoing records, we write straight into the socket
+	SetupStep setup;	// connection setup in progress
+	short setup_events;	// POLLIN or POLLOUT, the setup is waiting for the socket
+	double setup_deadline;	// the connection is expected to be ready by this time
+	int early;	// the first request goes out as early data
+	size_t early_written;	// early data accepted by OpenSSL
+
+	// queries
+	DnsQuery *queue;	// waiting to be sent
+	DnsQuery *queue_last;
+	DnsQuery *wire;	// HTTP/1.1: sent to the server, the responses come back in this order
+	DnsQuery *wire_last;
+	int wire_cnt;
+	DnsQuery *sent[H2_STREAMS_MAX];	// HTTP/2 and DoT: waiting for the response, one entry for each stream
+	uint16_t dot_id[SSL_DOT_MAX];	// DoT: DNS id used on the wire for the query in sent[]
+	uint16_t dot_seq;	// DoT: sequence number for the next DNS id
+	int batch;	// queries added in the current event loop pass, not sent yet
+
+	// HTTP/1.1 and DoT buffers
+	uint8_t out[SSL_BUFSIZE];
+	int outlen;
+	uint8_t in[SSL_BUFSIZE];
+	int inlen;
+	int inpos;	// start of the response being parsed
+	H1Parser parser;
+} SSLConn;
+static SSLConn **conn = NULL;
+static int conn_len = 0;	// number of connections in use
+static int conn_max = 0;	// number of connections allocated
+static int session_fd = -1;	// TLS session file, opened before chroot
+static double next_deadline = 0;	// earliest query or write deadline, 0 if none
+static double hedge_budget = 0;	// hedged requests we are allowed to send
+static DnsQuery *hold = NULL;	// queries waiting for a connection to come back, --reconnect-wait
+static DnsQuery *hold_last = NULL;
+static int hold_cnt = 0;
+#define SESSION_FILE_MAX (64 * 1024)
 
 static void ssl_alert_callback(const SSL *s, int where, int ret) {
 	const char *str;
@@ -68,30 +140,6 @@ static void ssl_alert_callback(const SSL *s, int where, int ret) {
 	}
 }
 
-int ssl_status_check(void) {
-	if (ssl == NULL)
-		return 0;
-
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	int fd = SSL_get_fd(ssl);
-	FD_SET(fd, &readfds);
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 1;
-
-	int rv = select(fd + 1, &readfds, NULL, NULL, &timeout);
-	if (rv <= 0)
-		return 0;
-
-	if (FD_ISSET(fd, &readfds)) {
-		printf("incoming data\n");
-		return 1;
-	}
-
-	return 0;
-}
-
 void ssl_init(void) {
 	SSL_load_error_strings();
 	SSL_library_init();
@@ -120,10 +168,429 @@ char *get_cert_file(void) {
 	return NULL;
 }
 
-void ssl_open(void) {
-	assert(ssl_state == SSL_CLOSED);
-	DnsServer *srv = server_get();
+
+// find the pool connection for this server; allocate a new one if necessary
+static SSLConn *ssl_conn_get(DnsServer *srv) {
 	assert(srv);
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		if (conn[i]->srv == srv)
+			return conn[i];
+	}
+
+	if (conn_len == conn_max) {
+		conn_max += 8;
+		conn = realloc(conn, conn_max * sizeof(SSLConn *));
+		if (!conn)
+			errExit("realloc");
+	}
+
+	// the connection is referenced by the event loop, it never moves in memory
+	SSLConn *c = malloc(sizeof(SSLConn));
+	if (!c)
+		errExit("malloc");
+	memset(c, 0, sizeof(SSLConn));
+	c->srv = srv;
+	c->fd = -1;
+	c->state = SSL_CLOSED;
+	h1_init(&c->parser, MAXBUF);
+	conn[conn_len++] = c;
+	return c;
+}
+
+static inline int connect_timeout(DnsServer *srv) {
+	return (srv->connect_timeout) ? srv->connect_timeout : arg_connect_timeout;
+}
+
+static inline int write_timeout(DnsServer *srv) {
+	return (srv->write_timeout) ? srv->write_timeout : arg_write_timeout;
+}
+
+static inline int read_timeout(DnsServer *srv) {
+	return (srv->read_timeout) ? srv->read_timeout : arg_read_timeout;
+}
+
+// ssl_timeout() runs no later than when
+static inline void ssl_deadline(double when) {
+	if (next_deadline == 0 || when < next_deadline)
+		next_deadline = when;
+}
+
+// a query still waiting at the server p95 response time is sent to a second server;
+// returns the time, 0 if the query is not hedged
+static inline double hedge_time(SSLConn *c, DnsQuery *q) {
+	if (q->hedged || q->keepalive || q->abandoned || q->retry || c->srv->p95 == 0)
+		return 0;
+	return q->sent + c->srv->p95;
+}
+
+// the query went out on the connection: start the read timeout and the hedge timer
+static void ssl_query_wire(SSLConn *c, DnsQuery *q) {
+	q->deadline = event_clock() + read_timeout(c->srv);
+	ssl_deadline(q->deadline);
+	double hedge = hedge_time(c, q);
+	if (hedge)
+		ssl_deadline(hedge);
+}
+
+// returns 1 if at least one connection in the pool is open
+static int ssl_any_open(void) {
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		if (conn[i]->state == SSL_OPEN)
+			return 1;
+	}
+	return 0;
+}
+
+// ssl_state is SSL_OPEN as long as at least one connection in the pool is open, or closed
+// only because it was idle
+static void ssl_update_state(void) {
+	SSLState old = ssl_state;
+	ssl_state = SSL_CLOSED;
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		if (conn[i]->state == SSL_OPEN || conn[i]->idle) {
+			ssl_state = SSL_OPEN;
+			break;
+		}
+	}
+
+	// the frontend tracks the encryption status using these two messages
+	if (old == SSL_CLOSED && ssl_state == SSL_OPEN)
+		rlogprintf("SSL connection opened\n");
+	else if (old == SSL_OPEN && ssl_state == SSL_CLOSED)
+		rlogprintf("SSL connection closed\n");
+
+	// state of each connection in the pool, reported to the frontend when it changes
+	static char pool_state[MAXBUF];
+	char buf[MAXBUF];
+	int open = 0;
+	int len = 0;
+	for (i = 0; i < conn_len; i++) {
+		SSLConn *c = conn[i];
+		const char *state;
+		if (c->state == SSL_OPEN) {
+			state = "open";
+			open++;
+		}
+		else if (c->setup != SETUP_NONE)
+			state = "connecting";
+		else if (c->idle)
+			state = "idle";
+		else
+			state = (c->srv->breaker == BREAKER_CLOSED) ? "down" : "out";
+		int n = snprintf(buf + len, sizeof(buf) - len, ", %s %s", c->srv->name, state);
+		if (n < 0 || n >= (int) sizeof(buf) - len)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+	if (conn_len && strcmp(buf, pool_state)) {
+		strcpy(pool_state, buf);
+		rlogprintf("SSL pool: %d/%d open%s\n", open, conn_len, pool_state);
+	}
+}
+
+// write the pending output; if the socket buffer is full we wait for EPOLLOUT
+// returns -1 if error
+static int ssl_flush(SSLConn *c) {
+	uint8_t *buf = (c->h2) ? c->h2->out : c->out;
+	int *len = (c->h2) ? &c->h2->outlen : &c->outlen;
+
+	// errors left over by a different connection would make the write fail
+	ERR_clear_error();
+	while (*len > 0) {
+		int n;
+		if (c->ktls_send) {
+			n = send(SSL_get_fd(c->ssl), buf, *len, MSG_NOSIGNAL);
+			if (n == -1 && errno == EINTR)
+				continue;
+		}
+		else
+			n = BIO_write(c->bio, buf, *len);
+		if (n <= 0) {
+			if ((c->ktls_send) ? (n == -1 && errno == EAGAIN) : BIO_should_retry(c->bio)) {
+				if (c->fd != -1) {
+					event_mod(c->fd, EPOLLIN | EPOLLOUT);
+					if (c->write_deadline == 0) {
+						c->write_deadline = event_clock() + write_timeout(c->srv);
+						ssl_deadline(c->write_deadline);
+					}
+				}
+				return 0;
+			}
+			rlogprintf("Error: failed SSL write, retval %d\n", n);
+			return -1;
+		}
+		c->write_deadline = 0;
+		if (arg_debug)
+			printf("(%d) SSL write %d/%d bytes\n", arg_id, n, *len);
+		memmove(buf, buf + n, *len - n);
+		*len -= n;
+
+		// HTTP/2 control frames waiting for space in the output buffer
+		if (*len == 0 && c->h2)
+			h2_control(c->h2);
+	}
+
+	if (c->fd != -1)
+		event_mod(c->fd, EPOLLIN);
+	return 0;
+}
+
+// read incoming HTTP/2 frames; returns -1 if error
+static int ssl_h2_read(SSLConn *c) {
+	uint8_t buf[MAXBUF];
+	ERR_clear_error();
+	while (1) {
+		int len = BIO_read(c->bio, buf, sizeof(buf));
+		if (len <= 0) {
+			if (BIO_should_retry(c->bio))
+				return 0;
+			rlogprintf("Error: failed SSL read, retval %d\n", len);
+			return -1;
+		}
+
+		if (h2_input(c->h2, buf, len)) {
+			rlogprintf("Error: HTTP/2 protocol error on %s\n", c->srv->name);
+			return -1;
+		}
+	}
+}
+
+// move the first query in the queue on the wire, and add the HTTP/1.1 request to the output buffer
+// returns 1 if done, 0 if the output buffer is full, -1 if error
+static int ssl_h1_request(SSLConn *c) {
+	DnsQuery *q = c->queue;
+	assert(q);
+	DnsServer *srv = c->srv;
+
+	// prebuilt header, content-length value, DNS query; the digits are written backwards
+	// in front of the header end
+	char clen[16];
+	char *digits = clen + 10;
+	memcpy(digits, "\r\n\r\n", 4);
+	unsigned v = q->len;
+	do {
+		*--digits = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	int clen_len = clen + 14 - digits;
+	int len = srv->request_len + clen_len + q->len;
+	if (len > (int) sizeof(c->out) - c->outlen) {
+		if (c->outlen == 0) {
+			rlogprintf("Warning: DNS request too large\n");
+			return -1;
+		}
+		return 0;
+	}
+	uint8_t *ptr = c->out + c->outlen;
+	memcpy(ptr, srv->request, srv->request_len);
+	ptr += srv->request_len;
+	memcpy(ptr, digits, clen_len);
+	ptr += clen_len;
+	memcpy(ptr, q->query, q->len);
+	c->outlen += len;
+
+	c->queue = q->next;
+	if (!c->queue)
+		c->queue_last = NULL;
+	q->next = NULL;
+	if (c->wire_last)
+		c->wire_last->next = q;
+	else
+		c->wire = q;
+	c->wire_last = q;
+	c->wire_cnt++;
+	ssl_query_wire(c, q);
+	if (arg_debug)
+		printf("(%d) *** SSL transaction %s, %d on the wire ***\n", arg_id, c->srv->name, c->wire_cnt);
+	return 1;
+}
+
+// put the queries on the wire back in the queue; nothing was sent to the server
+static void ssl_h1_unsend(SSLConn *c) {
+	if (c->wire) {
+		c->wire_last->next = c->queue;
+		c->queue = c->wire;
+		if (!c->queue_last)
+			c->queue_last = c->wire_last;
+	}
+	c->wire = NULL;
+	c->wire_last = NULL;
+	c->wire_cnt = 0;
+	c->outlen = 0;
+}
+
+// DoT: move the first query in the queue on the wire, with the 2 bytes length prefix (RFC 7858)
+// The DNS id is replaced with a value unique on this connection: it carries the index
+// in sent[] and a sequence number, and the responses are matched using this id.
+// returns 1 if done, 0 if no more queries can be sent for now
+static int ssl_dot_request(SSLConn *c) {
+	DnsQuery *q = c->queue;
+	assert(q);
+	if (q->len + 2 > (int) sizeof(c->out) - c->outlen)
+		return 0;
+
+	int i;
+	for (i = 0; i < SSL_DOT_MAX; i++) {
+		if (!c->sent[i])
+			break;
+	}
+	if (i == SSL_DOT_MAX)
+		return 0;
+
+	uint16_t id = (c->dot_seq++ * SSL_DOT_MAX) + i;
+	uint8_t *ptr = c->out + c->outlen;
+	ptr[0] = q->len >> 8;
+	ptr[1] = q->len & 0xff;
+	memcpy(ptr + 2, q->query, q->len);
+	ptr[2] = id >> 8;
+	ptr[3] = id & 0xff;
+	c->outlen += q->len + 2;
+
+	c->queue = q->next;
+	if (!c->queue)
+		c->queue_last = NULL;
+	q->stream = i;
+	ssl_query_wire(c, q);
+	c->sent[i] = q;
+	c->dot_id[i] = id;
+	if (arg_debug)
+		printf("(%d) *** DoT transaction %s, id %u ***\n", arg_id, c->srv->name, id);
+	return 1;
+}
+
+//**************************************************************************
+// TLS session resumption
+//**************************************************************************
+// write all the sessions in the session file: server name and DER-encoded session, each one
+// preceded by a 2 bytes length
+static void ssl_session_save(void) {
+	if (session_fd == -1)
+		return;
+
+	uint8_t buf[SESSION_FILE_MAX];
+	int len = 0;
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		SSLConn *c = conn[i];
+		if (!c->session)
+			continue;
+		int nlen = strlen(c->srv->name);
+		int slen = i2d_SSL_SESSION(c->session, NULL);
+		if (slen <= 0 || len + 4 + nlen + slen > (int) sizeof(buf))
+			continue;
+
+		buf[len++] = nlen >> 8;
+		buf[len++] = nlen & 0xff;
+		memcpy(buf + len, c->srv->name, nlen);
+		len += nlen;
+		buf[len++] = slen >> 8;
+		buf[len++] = slen & 0xff;
+		uint8_t *ptr = buf + len;
+		i2d_SSL_SESSION(c->session, &ptr);
+		len += slen;
+	}
+
+	if (pwrite(session_fd, buf, len, 0) != len || ftruncate(session_fd, len) == -1)
+		rlogprintf("Warning: cannot save TLS sessions\n");
+}
+
+// new session ticket from the server
+static int ssl_new_session(SSL *ssl, SSL_SESSION *sess) {
+	SSLConn *c = SSL_get_app_data(ssl);
+	if (!c || !SSL_SESSION_is_resumable(sess))
+		return 0;
+
+	if (arg_debug)
+		printf("(%d) new TLS session for %s, early data %u bytes\n",
+		       arg_id, c->srv->name, SSL_SESSION_get_max_early_data(sess));
+	if (c->session)
+		SSL_SESSION_free(c->session);
+	c->session = sess;	// we keep the reference
+	ssl_session_save();
+	return 1;
+}
+
+static void ssl_event(int fd, uint32_t events, void *arg);
+static void ssl_query_add(SSLConn *c, DnsQuery *q);
+static void ssl_fail_conn(SSLConn *c);
+static void ssl_retry(SSLConn *c, DnsQuery *q);
+static void ssl_probe_conn(SSLConn *c);
+static int ssl_send(SSLConn *c);
+
+// connection setup: wait until the socket is ready, events is POLLIN or POLLOUT
+// returns -1 if error or the connect timeout expired
+static int ssl_setup_wait(SSLConn *c, short events, double deadline) {
+	int fd = BIO_get_fd(c->bio, NULL);
+	if (fd < 0)
+		return -1;
+
+	int timeout = (int) (deadline - event_clock());
+	if (timeout > 0) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = events;
+		pfd.revents = 0;
+		int rv = poll(&pfd, 1, timeout);
+		if (rv > 0 || (rv == -1 && errno == EINTR))
+			return 0;
+		if (rv == -1)
+			return -1;
+	}
+
+	rlogprintf("Warning: connection to %s timed out\n", c->srv->name);
+	return -1;
+}
+
+// TCP socket for the connection, with the options set before connect(): no Nagle delay for
+// the small DoH requests, TCP Fast Open where the kernel supports it, and socket buffers sized
+// for a few TLS records; returns the socket, -1 if failed
+static int ssl_socket(DnsServer *srv) {
+	// the address was checked when the server list was loaded
+	char *addr = strdup(srv->address);
+	if (!addr)
+		errExit("strdup");
+	char *port = strrchr(addr, ':');
+	assert(port);
+	*port++ = '\0';
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(atoi(port));
+	int rv = inet_pton(AF_INET, addr, &sa.sin_addr);
+	free(addr);
+	if (rv != 1)
+		return -1;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef TCP_FASTOPEN_CONNECT
+	// the ClientHello goes out in the SYN packet once the server gave us a cookie
+	setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+#endif
+	int size = SSL_SOCKET_BUF;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// start the connection setup; returns -1 if failed
+static int ssl_setup_start(SSLConn *c) {
+	assert(c->state == SSL_CLOSED);
+	assert(c->setup == SETUP_NONE);
+	DnsServer *srv = c->srv;
+	c->idle = 0;
 
 	if (ctx == NULL) {
 		ctx = SSL_CTX_new(TLS_client_method());
@@ -140,387 +607,1275 @@ void ssl_open(void) {
 				exit(1);
 			}
 		}
-	}
 
+		// we store the session tickets ourselves, one for each server
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, ssl_new_session);
+	}
 
-	rlogprintf("Verifying certificates\n");
-	bio = BIO_new_ssl_connect(ctx);
-	BIO_get_ssl(bio, &ssl);
-	SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+	if (arg_debug)
+		printf("(%d) connecting to %s\n", arg_id, srv->name);
+	// the connection is set up on a non-blocking socket, within the connect timeout
+	ERR_clear_error();
+	c->setup_deadline = event_clock() + connect_timeout(srv);
+	int fd = ssl_socket(srv);
+	if (fd == -1)
+		return -1;
+	BIO *sbio = BIO_new_socket(fd, BIO_CLOSE);
+	c->bio = BIO_new_ssl(ctx, 1);
+	if (!sbio || !c->bio) {
+		if (sbio)
+			BIO_free(sbio);
+		else
+			close(fd);
+		return -1;
+	}
+	BIO_push(c->bio, sbio);
+	BIO_get_ssl(c->bio, &c->ssl);
+	SSL_set_mode(c->ssl, SSL_MODE_AUTO_RETRY | SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	if (arg_ktls)
+		SSL_set_options(c->ssl, SSL_OP_ENABLE_KTLS);
 
-	// set connection and SNI
-	BIO_set_conn_hostname(bio, srv->address);
+	// set SNI
 	if (srv->sni)
-		SSL_set_tlsext_host_name(ssl, srv->host);
+		SSL_set_tlsext_host_name(c->ssl, srv->host);
 	else
-		SSL_set_tlsext_host_name(ssl, sni_cloak());
+		SSL_set_tlsext_host_name(c->ssl, sni_cloak());
+
+	// offer HTTP/2 using ALPN
+	if (srv->h2_streams && !srv->dot)
+		SSL_set_alpn_protos(c->ssl, alpn_h2, sizeof(alpn_h2) - 1);
+
+	// resume the previous session; if the server allows it, the first query in the queue
+	// goes out as early data (0-RTT) together with the handshake - HTTP/1.1 only,
+	// on HTTP/2 we need the server SETTINGS before sending requests
+	c->early = 0;
+	c->early_written = 0;
+	SSL_set_app_data(c->ssl, c);
+	if (c->session) {
+		SSL_set_session(c->ssl, c->session);
+
+		const unsigned char *alpn = NULL;
+		size_t alpn_len = 0;
+		SSL_SESSION_get0_alpn_selected(c->session, &alpn, &alpn_len);
+		if (SSL_SESSION_get_max_early_data(c->session) > 0 && c->queue && !srv->dot &&
+		    !(alpn_len == 2 && memcmp(alpn, "h2", 2) == 0) &&
+		    ssl_h1_request(c) == 1)
+			c->early = 1;
+	}
 
-	if(BIO_do_connect(bio) <= 0) {
-//		rlogprintf("Error: cannot connect SSL.\n");
-		return;
+	c->setup = (c->early) ? SETUP_EARLY : SETUP_HANDSHAKE;
+	return 0;
+}
+
+// the TLS handshake is finished: check the certificate, and set up the protocol negotiated
+// by the server; returns -1 if failed
+static int ssl_setup_handshake_done(SSLConn *c) {
+	DnsServer *srv = c->srv;
+	if (c->early) {
+		int accepted = (SSL_get_early_data_status(c->ssl) == SSL_EARLY_DATA_ACCEPTED);
+		if (accepted) {
+			// this part of the request is already out
+			c->outlen -= c->early_written;
+			memmove(c->out, c->out + c->early_written, c->outlen);
+		}
+		// else the request is sent again after the handshake
+		if (arg_debug)
+			printf("(%d) early data %s by %s\n", arg_id, (accepted) ? "accepted" : "rejected", srv->name);
 	}
+	if (SSL_session_reused(c->ssl) && arg_debug)
+		printf("(%d) TLS session resumed for %s\n", arg_id, srv->name);
 
-	rlogprintf("Verifying certificates\n");
 	int val;
-	if ((val = SSL_get_verify_result(ssl)) != X509_V_OK) {
-		rlogprintf("Error: cannot handle certificate verification (error %d), shutting down...\n", val);
-		return;	// give the program a chance to switch to fallback
+	if ((val = SSL_get_verify_result(c->ssl)) != X509_V_OK) {
+		rlogprintf("Error: cannot handle certificate verification for %s (error %d)\n", srv->name, val);
+		return -1;	// give the program a chance to switch to fallback
 	}
 
 	// set alert callback
-	SSL_set_info_callback(ssl, ssl_alert_callback);
+	SSL_set_info_callback(c->ssl, ssl_alert_callback);
 
+	// kTLS is set up by OpenSSL at the end of the handshake if the kernel supports the cipher;
+	// the incoming records still go through SSL_read(), the session tickets and the alerts
+	// are passed to OpenSSL as control messages
+	if (arg_ktls) {
+		c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+		if (arg_debug)
+			printf("(%d) kTLS send %s, receive %s for %s\n", arg_id,
+			       (c->ktls_send) ? "on" : "off",
+			       (BIO_get_ktls_recv(SSL_get_rbio(c->ssl))) ? "on" : "off", srv->name);
+	}
 
-	ssl_state = SSL_OPEN;
-	rlogprintf("SSL connection opened\n");
+	// HTTP/2 negotiated by the server
+	const unsigned char *proto = NULL;
+	unsigned proto_len = 0;
+	SSL_get0_alpn_selected(c->ssl, &proto, &proto_len);
+	if (proto_len == 2 && memcmp(proto, "h2", 2) == 0) {
+		// a rejected HTTP/1.1 early data request goes back in the queue
+		ssl_h1_unsend(c);
+		c->h2 = malloc(sizeof(H2Conn));
+		if (!c->h2)
+			errExit("malloc");
+		h2_init(c->h2, srv->h2_streams);
+	}
+	return 0;
+}
 
-	// try to send a keepalive
-	ssl_keepalive();
+// run the connection setup as far as it goes without blocking; returns 0 when the connection
+// is ready, 1 if waiting for c->setup_events on the socket, -1 if failed
+static int ssl_setup_step(SSLConn *c) {
+	if (c->setup == SETUP_EARLY) {
+		// the TCP connection is still opening, the early data is sent with the ClientHello
+		int rv = SSL_write_early_data(c->ssl, c->out, c->outlen, &c->early_written);
+		if (rv != 1) {
+			int err = SSL_get_error(c->ssl, rv);
+			if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_CONNECT) {
+				if (arg_debug)
+					printf("(%d) early data failed for %s\n", arg_id, c->srv->name);
+				return -1;
+			}
+			c->setup_events = (err == SSL_ERROR_WANT_READ) ? POLLIN : POLLOUT;
+			return 1;
+		}
+		c->setup = SETUP_HANDSHAKE;
+	}
+
+	if (c->setup == SETUP_HANDSHAKE) {
+		if (BIO_do_connect(c->bio) <= 0) {
+			if (!BIO_should_retry(c->bio))
+				return -1;
+			c->setup_events = (BIO_should_read(c->bio)) ? POLLIN : POLLOUT;
+			return 1;
+		}
+		if (ssl_setup_handshake_done(c))
+			return -1;
+		if (!c->h2) {
+			c->setup = SETUP_NONE;
+			return 0;
+		}
+		c->setup = SETUP_H2_PREFACE;
+	}
+
+	// HTTP/2: send the preface and wait for the server SETTINGS
+	if (c->setup == SETUP_H2_PREFACE) {
+		if (ssl_flush(c))
+			return -1;
+		if (c->h2->outlen) {
+			c->setup_events = POLLOUT;
+			return 1;
+		}
+		c->setup = SETUP_H2_SETTINGS;
+	}
+	if (ssl_h2_read(c))
+		return -1;
+	if (!c->h2->settings) {
+		c->setup_events = POLLIN;
+		return 1;
+	}
+	c->setup = SETUP_NONE;
+	return 0;
 }
 
-void ssl_close(void) {
-	rlogprintf("Going to close conn\n");
-	int rv = SSL_shutdown(ssl);
-	if (rv == 0)
-		SSL_shutdown(ssl);
-	SSL_free(ssl);
-	ssl = NULL;
-	ssl_state = SSL_CLOSED;
-	rlogprintf("SSL connection closed\n");
+// the connection setup is finished: rv is 0 if the connection is ready, -1 if it failed
+static void ssl_setup_end(SSLConn *c, int rv) {
+	DnsServer *srv = c->srv;
+	c->setup = SETUP_NONE;
+	if (c->fd != -1)
+		event_del(c->fd);
+	c->fd = -1;
+
+	if (rv) {
+		c->connect_fail = event_clock();
+		ssl_h1_unsend(c);
+		BIO_free_all(c->bio);
+		c->bio = NULL;
+		c->ssl = NULL;
+		c->ktls_send = 0;
+		free(c->h2);
+		c->h2 = NULL;
+		return;
+	}
+
+	if (arg_debug)
+		printf("(%d) %s connected using %s\n", arg_id, srv->name,
+		       (c->h2) ? "HTTP/2" : (srv->dot) ? "DoT" : "HTTP/1.1");
+
+	// from now on the socket is driven by the event loop
+	c->fd = SSL_get_fd(c->ssl);
+	event_add(c->fd, EPOLLIN, ssl_event, c);
+
+	c->state = SSL_OPEN;
+	c->keepalive_cnt = srv->ssl_keepalive;
+	c->active = event_clock();
+	c->connect_fail = 0;
+
+	// the queries waiting for a connection go out on this one
+	while (hold) {
+		DnsQuery *q = hold;
+		hold = q->next;
+		ssl_query_add(c, q);
+	}
+	hold_last = NULL;
+	hold_cnt = 0;
 }
 
-// returns the length of the response,0 if failed
-int ssl_dns(uint8_t *msg, int cnt) {
-	assert(msg);
+// open the connection, waiting for the setup to finish
+static void ssl_open_conn(SSLConn *c) {
+	assert(c);
+	if (c->state == SSL_OPEN || c->setup != SETUP_NONE)
+		return;
 
-	DnsServer *srv = server_get();
-	assert(srv);
+	int rv = ssl_setup_start(c);
+	while (rv == 0 && (rv = ssl_setup_step(c)) == 1)
+		rv = ssl_setup_wait(c, c->setup_events, c->setup_deadline);
+	ssl_setup_end(c, rv);
+}
 
-	if (ssl == NULL || ssl_state != SSL_OPEN){
-		printf("SSL state fail\n");
-		return 0;
+static inline uint32_t ssl_setup_epoll(SSLConn *c) {
+	return (c->setup_events == POLLIN) ? EPOLLIN : EPOLLOUT;
+}
+
+// the connection setup running in the background is finished
+static void ssl_setup_done(SSLConn *c, int rv) {
+	ssl_setup_end(c, rv);
+	if (rv) {
+		// the queries waiting for the connection go to the other servers
+		ssl_fail_conn(c);
+		return;
 	}
+	if (c->srv->breaker == BREAKER_HALF_OPEN)
+		ssl_probe_conn(c);
+	ssl_update_state();
 
-	assert(bio);
-	assert(ctx);
-	assert(ssl);
+	// the queries added while the connection was opening
+	if (ssl_send(c))
+		ssl_fail_conn(c);
+}
 
-	char buf[MAXBUF];
-	sprintf(buf, srv->request, cnt);
-	int len = strlen(buf);
-	assert(cnt < MAXBUF - len);
+// socket events during the connection setup
+static void ssl_setup_event(int fd, uint32_t events, void *arg) {
+	(void) fd;
+	(void) events;
+	SSLConn *c = arg;
+	int rv = ssl_setup_step(c);
+	if (rv == 1)
+		event_mod(c->fd, ssl_setup_epoll(c));
+	else
+		ssl_setup_done(c, rv);
+}
 
-	memcpy(buf + len, msg, cnt);
-	len += cnt;
+// open the connection in the background, driven by the event loop; the queries added to the
+// connection go out when the setup is finished, or they are moved to the other connections
+// if the setup fails
+// returns -1 if failed
+static int ssl_open_async(SSLConn *c) {
+	assert(c);
+	if (c->state == SSL_OPEN || c->setup != SETUP_NONE)
+		return 0;
 
-	if (arg_debug)
-		printf("(%d) *** SSL transaction ***\n", arg_id);
+	int rv = ssl_setup_start(c);
+	if (rv == 0)
+		rv = ssl_setup_step(c);
+	if (rv != 1) {
+		ssl_setup_done(c, rv);
+		return rv;
+	}
 
-	int lentx;
-	if((lentx = BIO_write(bio, buf, len)) <= 0) {
-		if(! BIO_should_retry(bio)) {
-			rlogprintf("Error: failed SSL write, retval %d\n", lentx);
-			goto errout;
-		}
-		if((lentx = BIO_write(bio, buf, len)) <= 0) {
-			rlogprintf("Error: failed SSL write, retval %d\n", lentx);
-			goto errout;
+	c->fd = BIO_get_fd(c->bio, NULL);
+	event_add(c->fd, ssl_setup_epoll(c), ssl_setup_event, c);
+	ssl_deadline(c->setup_deadline);
+	event_wakeup(c->setup_deadline);
+	return 0;
+}
+
+// close the connection; the queries are left in place
+static void ssl_close_conn(SSLConn *c) {
+	assert(c);
+	if (c->fd != -1)
+		event_del(c->fd);
+	c->fd = -1;
+	if (c->bio) {
+		if (arg_debug)
+			printf("(%d) closing connection to %s\n", arg_id, c->srv->name);
+		if (c->state == SSL_OPEN)
+			SSL_shutdown(c->ssl);
+		BIO_free_all(c->bio);	// this also frees the SSL structure
+	}
+	c->bio = NULL;
+	c->ssl = NULL;
+	c->ktls_send = 0;
+	free(c->h2);
+	c->h2 = NULL;
+	c->outlen = 0;
+	c->inlen = 0;
+	c->inpos = 0;
+	h1_init(&c->parser, MAXBUF);
+	c->write_deadline = 0;
+	c->ping_deadline = 0;
+	c->setup = SETUP_NONE;
+	c->state = SSL_CLOSED;
+}
+
+// partial response parsing; the response is cached
+// returns the length of the response, 0 if failed
+static int ssl_rx(DnsQuery *q, uint8_t *reply, int len) {
+	cache_set_name(q->cname, q->cname_type);
+	int rv = lint_rx(reply, len);
+	// the response is cached using the smallest TTL in the answer, or the SOA TTL
+	int ttl = lint_ttl();
+	if (ttl < 0)
+		ttl = CACHE_TTL_ERROR;
+	if (rv) {
+		if (lint_error() == DNSERR_NXDOMAIN) {
+			cache_set_reply(reply, len, ttl);
+			return len;
 		}
+
+		logprintf("Error: RX %s\n", lint_err2str());
+		return 0;
 	}
 
-	if (arg_debug)
-		printf("(%d) SSL write %d/%d bytes\n", arg_id, len, lentx);
+	// cache the response and exit
+	cache_set_reply(reply, len, ttl);
+	return len;
+}
 
-	len = BIO_read(bio, buf, MAXBUF);
-	if(len <= 0) {
-		if(! BIO_should_retry(bio)) {
-			rlogprintf("Error: failed SSL read, retval %d\n", len);
-			goto errout;
+// break the link between a query and its copy on a different server
+static void ssl_unhedge(DnsQuery *q) {
+	assert(q->hedge);
+	q->hedge->hedge = NULL;
+	q->hedge = NULL;
+}
+
+// the query is finished: reply/len is the response, len is 0 if no DNS data came back,
+// -1 if the request failed and should go to the next server in the pool
+static void ssl_query_done(SSLConn *c, DnsQuery *q, uint8_t *reply, int len) {
+	if (len < 0) {
+		ssl_retry(c, q);
+		return;
+	}
+
+	assert(c->srv->pending > 0);
+	c->srv->pending--;
+	if (!q->abandoned)	// already counted when it timed out
+		server_pool_result(c->srv, event_clock() - q->sent);
+	if (q->hedge) {
+		// first response wins, the other one is dropped when it comes in
+		q->hedge->lost = 1;
+		ssl_unhedge(q);
+	}
+	if (len > 0) {
+		c->keepalive_cnt = c->srv->ssl_keepalive;
+		if (arg_debug) {
+			printf("(%d) DNS data:\n", arg_id);
+			print_mem(reply, len);
+			printf("(%d) *** SSL transaction end ***\n", arg_id);
 		}
-		len = BIO_read(bio, buf, MAXBUF);
-		if(len <= 0) {
-			rlogprintf("Error: failed SSL read, retval %d\n", len);
-			goto errout;
+	}
+
+	if (q->keepalive || q->abandoned || q->lost) {
+		free(q);
+		return;
+	}
+	if (len > 0)
+		len = ssl_rx(q, reply, len);
+	resolver_reply(q, reply, len);
+}
+
+// add the query at the end of the connection queue; the queries added during an event loop pass
+// are sent together by ssl_send_queued()
+static void ssl_query_add(SSLConn *c, DnsQuery *q) {
+	q->next = NULL;
+	if (c->queue_last)
+		c->queue_last->next = q;
+	else
+		c->queue = q;
+	c->queue_last = q;
+	q->sent = event_clock();
+	if (!q->keepalive)
+		c->active = q->sent;
+	c->srv->pending++;
+	c->batch++;
+}
+
+// the next open connection after c, preferably to a server with the circuit breaker closed;
+// returns NULL if there is none
+static SSLConn *ssl_next_open(SSLConn *c) {
+	int i;
+	for (i = 0; i < conn_len && conn[i] != c; i++);
+	SSLConn *next = NULL;
+	int j;
+	for (j = 1; j < conn_len; j++) {
+		SSLConn *n = conn[(i + j) % conn_len];
+		if (n->state != SSL_OPEN)
+			continue;
+		if (n->srv->breaker == BREAKER_CLOSED)
+			return n;
+		if (!next)
+			next = n;
+	}
+	return next;
+}
+
+// move the query to the next open connection in the pool, or send it to the fallback server
+static void ssl_resend(SSLConn *c, DnsQuery *q) {
+	assert(c->srv->pending > 0);
+	c->srv->pending--;
+	if (q->keepalive || q->abandoned || q->lost) {
+		free(q);
+		return;
+	}
+	if (q->hedge) {
+		// the copy on the other server is still in flight
+		ssl_unhedge(q);
+		free(q);
+		return;
+	}
+
+	if (q->retry < SSL_RETRY_MAX) {
+		SSLConn *next = ssl_next_open(c);
+		if (next) {
+			if (arg_debug)
+				printf("(%d) query moved from %s to %s\n", arg_id, c->srv->name, next->srv->name);
+			q->retry++;
+			ssl_query_add(next, q);
+			return;
 		}
 	}
-	buf[len] = '\0';
 
-	// check 200 OK
-	char *ptr = strstr(buf, "200 OK");
-	if (!ptr) {
-		rlogprintf("[Single] Warning: HTTP error, 200 OK not received\n");
-		printf("**************\n%s\n**************\n", buf);
-		fflush(0);
-		goto errout;
+	// all the connections are down: the query waits for a while, if a connection comes back
+	// it goes out there, otherwise it is sent to the fallback server by ssl_hold_timeout()
+	if (arg_reconnect_wait && hold_cnt < SSL_HOLD_MAX && !ssl_any_open() &&
+	    event_clock() < q->start + arg_reconnect_wait) {
+		if (arg_debug)
+			printf("(%d) query on hold, waiting for a connection\n", arg_id);
+		q->next = NULL;
+		if (hold_last)
+			hold_last->next = q;
+		else
+			hold = q;
+		hold_last = q;
+		hold_cnt++;
+		ssl_deadline(q->start + arg_reconnect_wait);
+		ssl_deadline(event_clock() + SSL_HOLD_RETRY);
+		return;
 	}
 
-	// look for the end of http header
-	ptr = strstr(buf, "\r\n\r\n");
-	if (!ptr) {
-		rlogprintf("Warning: cannot parse HTTPS response, didn't recieve a full http header\n");
-		printf("**************\n%s\n**************\n", buf);
-		fflush(0);
-		goto errout;
+	resolver_reply(q, NULL, -1);
+}
+
+// the query failed on this connection
+static void ssl_retry(SSLConn *c, DnsQuery *q) {
+	if (!q->abandoned)	// already counted when it timed out
+		server_pool_result(c->srv, -1);
+	ssl_resend(c, q);
+}
+
+// the queries on hold for too long go to the fallback server, and the connections are
+// tried again every SSL_HOLD_RETRY
+static void ssl_hold_timeout(double now) {
+	while (hold && now >= hold->start + arg_reconnect_wait) {
+		DnsQuery *q = hold;
+		hold = q->next;
+		hold_cnt--;
+		resolver_reply(q, NULL, -1);
+	}
+	if (!hold) {
+		hold_last = NULL;
+		return;
 	}
-	ptr += 4; // length of "\r\n\r\n"
-	ptrdiff_t hlen = ptr - buf; // +4 is the length of \r\n\r\n
-	*(ptr - 1) = 0;
-	if (arg_debug)
-		printf("(%d) http header:\n%s", arg_id, buf);
 
-	// look for Content-Length:
-	char *contlen = "Content-Length: ";
-	ptr = strcasestr(buf, contlen);
-	int datalen = 0;
-	if (!ptr) {
-		rlogprintf("Warning: cannot parse HTTPS response, content-length missing\n");
-		print_mem((uint8_t *) buf, len);
-		goto errout;
+	int i;
+	for (i = 0; i < conn_len && hold; i++) {
+		SSLConn *c = conn[i];
+		if (c->state == SSL_OPEN || c->setup != SETUP_NONE || c->srv->breaker != BREAKER_CLOSED)
+			continue;
+		if (c->connect_fail && now - c->connect_fail < SSL_HOLD_RETRY)
+			continue;
+		ssl_open_async(c);
 	}
-	else {
-		ptr += strlen(contlen);
-		sscanf(ptr, "%d", &datalen);
-		if (datalen == 0) // we got a "Content-lenght: 0"; this is probably a HTTP error
-			return 0;
+	ssl_update_state();
+
+	if (hold) {
+		ssl_deadline(hold->start + arg_reconnect_wait);
+		ssl_deadline(now + SSL_HOLD_RETRY);
+	}
+}
+
+// the query is slow: send a copy to the fastest healthy server with an open connection,
+// the first response wins; the number of hedged requests is capped by --hedge-rate
+static void ssl_hedge(SSLConn *c, DnsQuery *q) {
+	q->hedged = 1;	// only one try
+	if (hedge_budget < 1)
+		return;
+
+	SSLConn *next = NULL;
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		SSLConn *n = conn[i];
+		if (n == c || n->state != SSL_OPEN || n->srv->breaker != BREAKER_CLOSED || n->srv->err >= SCHED_ERR_MAX)
+			continue;
+		if (!next || (n->srv->rtt && (next->srv->rtt == 0 || n->srv->rtt < next->srv->rtt)))
+			next = n;
 	}
+	if (!next)
+		return;
 
-	// do we need to read more data?
-	int totallen = (int) hlen + datalen;
+	DnsQuery *r = malloc(sizeof(DnsQuery));
+	if (!r)
+		errExit("malloc");
+	memcpy(r, q, sizeof(DnsQuery));
+	r->hedge = q;
+	q->hedge = r;
+	ssl_query_add(next, r);
+	hedge_budget -= 1;
+	stats.hedge++;
+	stats.changed = 1;
 	if (arg_debug)
-		printf("(%d) SSL read len %d, totallen %d, datalen %d\n",
-		       arg_id, len, totallen, datalen);
-	if (totallen >= MAXBUF) {
-		rlogprintf("Warning: cannot parse HTTPS response, invalid length\n");
-		print_mem((uint8_t *) buf, len);
-		goto errout;
+		printf("(%d) query hedged from %s to %s after %.02f ms\n", arg_id, c->srv->name, next->srv->name,
+		       event_clock() - q->sent);
+}
+
+// close the connection and move all its queries to the other connections in the pool,
+// or to the fallback server; nothing is recorded against the server
+static void ssl_drop_conn(SSLConn *c) {
+	DnsQuery *list = c->queue;
+	c->queue = NULL;
+	c->queue_last = NULL;
+	if (c->wire) {
+		c->wire_last->next = list;
+		list = c->wire;
+	}
+	c->wire = NULL;
+	c->wire_last = NULL;
+	c->wire_cnt = 0;
+	int i;
+	for (i = 0; i < H2_STREAMS_MAX; i++) {
+		if (c->sent[i]) {
+			c->sent[i]->next = list;
+			list = c->sent[i];
+			c->sent[i] = NULL;
+		}
 	}
 
-	while (len < totallen) {
-		int rv = BIO_read(bio, buf + len, totallen - len);
-		if (arg_debug)
-			printf("(%d) SSL read + %d\n", arg_id, rv);
-		if(rv <= 0) {
-			if(! BIO_should_retry(bio)) {
-				rlogprintf("Error: failed SSL read\n");
-				goto errout;
-			}
-			rv = BIO_read(bio, buf, MAXBUF);
+	ssl_close_conn(c);
+	ssl_update_state();
+
+	while (list) {
+		DnsQuery *q = list;
+		list = list->next;
+		ssl_resend(c, q);
+	}
+}
+
+// the connection went down: one failure for the server, whatever the number of queries on it
+static void ssl_fail_conn(SSLConn *c) {
+	server_pool_result(c->srv, -1);
+	ssl_drop_conn(c);
+}
+
+// HTTP/2 responses; process the streams closed by the server
+static void ssl_h2_done(SSLConn *c) {
+	H2Conn *h = c->h2;
+	int i;
+	for (i = 0; i < H2_STREAMS_MAX; i++) {
+		DnsQuery *q = c->sent[i];
+		if (!q || h->stream[i].state == H2_STREAM_OPEN)
+			continue;
+
+		H2StreamState state = h->stream[i].state;
+		int len = -1;
+		if (state == H2_STREAM_DONE)
+			len = h->stream[i].len;
+		else if (state == H2_STREAM_ERROR)
+			rlogprintf("Warning: HTTP error, status %d received from %s\n", h->stream[i].status, c->srv->name);
+		h2_stream_free(h, i);
+		c->sent[i] = NULL;
+
+		// a refused stream is not a server error, the query goes out again on a different connection
+		if (state == H2_STREAM_REFUSED) {
 			if (arg_debug)
-				printf("(%d) SSL read + %d\n", arg_id, rv);
-			if(rv <= 0) {
-				rlogprintf("Error: SSL connection is probably closed\n");
-				goto errout;
-			}
+				printf("(%d) stream refused by %s\n", arg_id, c->srv->name);
+			ssl_resend(c, q);
 		}
+		else
+			ssl_query_done(c, q, q->reply, len);
+	}
+}
+
+// HTTP/1.1 response for the first query on the wire; the parser picks up where it stopped
+// on the previous read, and the DNS data is passed on straight from the receive buffer
+// returns 1 if a response was processed, 0 if we need more data, -1 if error
+static int ssl_h1_response(SSLConn *c) {
+	DnsQuery *q = c->wire;
+	if (!q) {
+		// nothing was requested, probably the session is going down
+		if (c->inlen > c->inpos) {
+			if (arg_debug)
+				printf("(%d) incoming data from %s\n", arg_id, c->srv->name);
+			c->keepalive_cnt = 0;
+		}
+		c->inlen = 0;
+		c->inpos = 0;
+		return 0;
+	}
 
-		len += rv;
+	H1Parser *p = &c->parser;
+	uint8_t *buf = c->in + c->inpos;
+	int rv = h1_parse(p, buf, c->inlen - c->inpos);
+	if (rv == 0)
+		return 0;	// wait for more data
+	if (rv == -1) {
+		rlogprintf("Warning: cannot parse HTTPS response from %s\n", c->srv->name);
+		return -1;
 	}
 
-	// copy the response in buf
-	memcpy(msg, buf + len - datalen, datalen);
 	if (arg_debug) {
-		printf("(%d) DNS data:\n", arg_id);
-		print_mem((uint8_t *) buf, datalen);
-		printf("(%d) *** SSL transaction end ***\n", arg_id);
+		printf("(%d) http header:\n%.*s", arg_id, p->hlen, (char *) buf);
+		printf("(%d) SSL response %d bytes, datalen %d%s\n",
+		       arg_id, p->pos, p->len, (p->chunked) ? ", chunked" : "");
 	}
 
-	//
-	// partial response parsing
-	//
-	if (lint_rx(msg, datalen)) {
-		if (lint_error() == DNSERR_NXDOMAIN) {
-			cache_set_reply(msg, datalen, CACHE_TTL_ERROR);
-			return datalen;
+	// a HTTP error goes to the next server in the pool; the connection is still good
+	int len = p->len;	// a "Content-Length: 0" is probably a HTTP error
+	if (p->status != 200) {
+		rlogprintf("Warning: HTTP error, status %d received from %s\n", p->status, c->srv->name);
+		len = -1;
+	}
+
+	c->wire = q->next;
+	if (!c->wire)
+		c->wire_last = NULL;
+	c->wire_cnt--;
+	c->inpos += p->pos;
+	uint8_t *reply = buf + p->body;
+	h1_init(p, MAXBUF);
+	ssl_query_done(c, q, reply, len);
+	return 1;
+}
+
+// DoT responses, in any order; returns -1 if error
+static int ssl_dot_response(SSLConn *c) {
+	while (c->inlen - c->inpos >= 2) {
+		uint8_t *ptr = c->in + c->inpos;
+		int len = (ptr[0] << 8) | ptr[1];
+		if (len < 12 || len > MAXBUF) {
+			rlogprintf("Warning: invalid DoT response from %s\n", c->srv->name);
+			return -1;
+		}
+		if (c->inlen - c->inpos < len + 2)
+			return 0;	// wait for more data
+		c->inpos += len + 2;
+
+		// a response nobody is waiting for - the query timed out - is dropped
+		uint8_t *reply = ptr + 2;
+		uint16_t id = (reply[0] << 8) | reply[1];
+		int i = id % SSL_DOT_MAX;
+		DnsQuery *q = c->sent[i];
+		if (!q || c->dot_id[i] != id) {
+			if (arg_debug)
+				printf("(%d) DoT response from %s dropped, id %u\n", arg_id, c->srv->name, id);
+			continue;
 		}
 
-		logprintf("Error: RX %s\n", lint_err2str());
-		return 0;
+		// restore the id from the client query
+		c->sent[i] = NULL;
+		reply[0] = q->query[0];
+		reply[1] = q->query[1];
+		ssl_query_done(c, q, reply, len);
 	}
+	return 0;
+}
 
-	// cache the response and exit
-	cache_set_reply(msg, datalen, arg_cache_ttl);
-	return datalen;
+// read incoming HTTP/1.1 or DoT data; returns -1 if error
+static int ssl_read(SSLConn *c) {
+	ERR_clear_error();
+	while (1) {
+		// drop the responses already processed
+		if (c->inpos) {
+			c->inlen -= c->inpos;
+			memmove(c->in, c->in + c->inpos, c->inlen);
+			c->inpos = 0;
+		}
+		if (c->inlen == sizeof(c->in)) {
+			rlogprintf("Warning: cannot parse HTTPS response, invalid length\n");
+			return -1;
+		}
 
-errout:
-	ssl_close();
-	return 0;
+		int len = BIO_read(c->bio, c->in + c->inlen, sizeof(c->in) - c->inlen);
+		if (len <= 0) {
+			if (BIO_should_retry(c->bio))
+				return 0;
+			rlogprintf("Error: failed SSL read, retval %d\n", len);
+			return -1;
+		}
+		if (arg_debug)
+			printf("(%d) SSL read + %d\n", arg_id, len);
+		c->inlen += len;
+
+		int rv;
+		if (c->srv->dot)
+			rv = ssl_dot_response(c);
+		else {
+			// pipelined responses come back in the same order as the requests
+			while ((rv = ssl_h1_response(c)) == 1);
+		}
+		if (rv == -1)
+			return -1;
+	}
 }
 
-int ssl_dns_pool(const char* domain, uint8_t *msg, int cnt) {
-	assert(msg);
+// move the queued queries on the wire; returns -1 if error
+static int ssl_send(SSLConn *c) {
+	DnsServer *srv = c->srv;
+
+	if (c->h2) {
+		H2Conn *h = c->h2;
+		while (c->queue) {
+			DnsQuery *q = c->queue;
+			// the request fails if there are no streams available or the output buffer is full;
+			// the query stays in the queue until one of the responses comes in
+			int index = h2_request(h, srv->host, srv->path, q->query, q->len, q->reply, sizeof(q->reply));
+			if (index == -1)
+				break;
+			c->queue = q->next;
+			if (!c->queue)
+				c->queue_last = NULL;
+			q->stream = index;
+			ssl_query_wire(c, q);
+			c->sent[index] = q;
+			if (arg_debug)
+				printf("(%d) *** HTTP/2 transaction %s, stream %u ***\n", arg_id, srv->name, h->stream[index].id);
+		}
 
-	DnsServer *srv = server_pool_get(domain);
-	assert(srv);
+		// the server is shutting down the connection; reconnect after the last response came in
+		if (h->goaway && h->active == 0) {
+			if (arg_debug)
+				printf("(%d) HTTP/2 connection to %s exhausted\n", arg_id, srv->name);
+			ssl_close_conn(c);
+			ssl_open_async(c);	// the queries go out when the new connection is ready
+			ssl_update_state();
+			return 0;
+		}
+	}
 
-	if (ssl == NULL || ssl_state != SSL_OPEN){
-		printf("SSL state fail\n");
-		return 0;
+	// DoT: all the queries are pipelined, the responses come back in any order
+	else if (srv->dot) {
+		while (c->queue && ssl_dot_request(c));
+	}
+
+	// HTTP/1.1: one request at a time, or a batch of requests written back-to-back
+	// for servers that accept pipelining
+	else {
+		int max = (srv->pipelining) ? SSL_PIPELINE_MAX : 1;
+		while (c->queue && c->wire_cnt < max) {
+			int rv = ssl_h1_request(c);
+			if (rv == -1)
+				return -1;
+			if (rv == 0)
+				break;	// the output buffer is full
+		}
 	}
 
-	rlogprintf(" ----------------------------\n - Attempting to use resolver %s to resolve domain %s\n ----------------------------\n", srv->name, domain);
+	c->batch = 0;
+	return ssl_flush(c);
+}
 
-	assert(bio);
-	assert(ctx);
-	assert(ssl);
+// data coming in on a pool connection, or the socket is ready for more output
+static void ssl_event(int fd, uint32_t events, void *arg) {
+	(void) fd;
+	(void) events;
+	SSLConn *c = arg;
+	assert(c->state == SSL_OPEN);
+
+	int rv;
+	if (c->h2) {
+		rv = ssl_h2_read(c);
+		ssl_h2_done(c);
+	}
+	else
+		rv = ssl_read(c);
 
-	char buf[MAXBUF];
-	sprintf(buf, srv->request, cnt);
-	int len = strlen(buf);
-	assert(cnt < MAXBUF - len);
+	if (rv == 0 && c->state == SSL_OPEN)
+		rv = ssl_send(c);
+	if (rv)
+		ssl_fail_conn(c);
+}
 
-	memcpy(buf + len, msg, cnt);
-	len += cnt;
+// send a DNS query with no client on the connection; the result goes to the server scheduler
+static void ssl_probe_conn(SSLConn *c) {
+	assert(c);
+	if (c->state != SSL_OPEN)
+		return;
+	c->keepalive_cnt = c->srv->ssl_keepalive;
 
+	// the connection is in use, no need for a probe
+	if (c->srv->pending)
+		return;
 	if (arg_debug)
-		printf("(%d) *** SSL transaction ***\n", arg_id);
+		printf("(%d) send probe to %s\n", arg_id, c->srv->name);
+
+	uint8_t msg[] = { // www.example.com
+		0x00, 0x00, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x03, 0x77, 0x77, 0x77,
+		0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,  0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00,
+		0x01
+	};
+	DnsQuery *q = malloc(sizeof(DnsQuery));
+	if (!q)
+		errExit("malloc");
+	memset(q, 0, sizeof(DnsQuery));
+	q->keepalive = 1;
+	memcpy(q->query, msg, sizeof(msg));
+	q->len = sizeof(msg);
+	ssl_query_add(c, q);
+}
+
+// keep an idle connection open: HTTP/2 connections get a PING frame, the rest a DNS query;
+// a connection without client queries for SSL_IDLE_TIMER is closed, the TLS session is kept
+// and the next query resumes it
+static void ssl_keepalive_conn(SSLConn *c) {
+	assert(c);
+	if (c->state != SSL_OPEN)
+		return;
+	c->keepalive_cnt = c->srv->ssl_keepalive;
+
+	// the connection is in use, no need for a keepalive
+	if (c->srv->pending)
+		return;
 
-	int lentx;
-	if((lentx = BIO_write(bio, buf, len)) <= 0) {
-		if(! BIO_should_retry(bio)) {
-			rlogprintf("Error: failed SSL write, retval %d\n", lentx);
-			goto errout;
+	if (event_clock() - c->active >= SSL_IDLE_TIMER * 1000) {
+		if (arg_debug)
+			printf("(%d) connection to %s idle, closing it\n", arg_id, c->srv->name);
+		ssl_close_conn(c);
+		c->idle = 1;
+		return;
+	}
+
+	if (!c->h2) {
+		ssl_probe_conn(c);
+		return;
+	}
+	if (c->h2->ping || h2_ping(c->h2))
+		return;
+	if (arg_debug)
+		printf("(%d) send PING to %s\n", arg_id, c->srv->name);
+	c->ping_deadline = event_clock() + read_timeout(c->srv);
+	ssl_deadline(c->ping_deadline);
+	if (ssl_flush(c))
+		ssl_fail_conn(c);
+}
+
+// queries waiting too long for a response are moved to a different server, and the connections
+// that stopped accepting data are closed
+// returns -1 if the connection should be closed
+static int ssl_conn_timeout(SSLConn *c, double now) {
+	if (c->write_deadline) {
+		if (now >= c->write_deadline) {
+			rlogprintf("Warning: write timeout on %s\n", c->srv->name);
+			return -1;
 		}
-		if((lentx = BIO_write(bio, buf, len)) <= 0) {
-			rlogprintf("Error: failed SSL write, retval %d\n", lentx);
-			goto errout;
+		ssl_deadline(c->write_deadline);
+	}
+	if (c->h2 && c->h2->ping) {
+		if (now >= c->ping_deadline) {
+			rlogprintf("Warning: no PING acknowledgment from %s, closing the connection\n", c->srv->name);
+			return -1;
 		}
+		ssl_deadline(c->ping_deadline);
 	}
 
-	if (arg_debug)
-		printf("(%d) SSL write %d/%d bytes\n", arg_id, len, lentx);
+	int expired = 0;
+	if (c->h2 || c->srv->dot) {
+		int i;
+		for (i = 0; i < H2_STREAMS_MAX; i++) {
+			DnsQuery *q = c->sent[i];
+			if (!q)
+				continue;
+			if (now < q->deadline) {
+				ssl_deadline(q->deadline);
+				double hedge = hedge_time(c, q);
+				if (hedge && now >= hedge)
+					ssl_hedge(c, q);
+				else if (hedge)
+					ssl_deadline(hedge);
+				continue;
+			}
 
-	len = BIO_read(bio, buf, MAXBUF);
-	if(len <= 0) {
-		if(! BIO_should_retry(bio)) {
-			rlogprintf("Error: failed SSL read, retval %d\n", len);
-			goto errout;
+			// HTTP/2: the stream is reset, and a late response is dropped by the HTTP/2 layer;
+			// DoT: a late response doesn't match the id any more
+			if (c->h2)
+				h2_stream_free(c->h2, i);
+			c->sent[i] = NULL;
+			ssl_retry(c, q);
+			expired++;
 		}
-		len = BIO_read(bio, buf, MAXBUF);
-		if(len <= 0) {
-			rlogprintf("Error: failed SSL read, retval %d\n", len);
-			goto errout;
+	}
+	else {
+		// the responses come back in order: a query that timed out keeps its place on the wire,
+		// and a copy goes to a different server
+		DnsQuery *q;
+		for (q = c->wire; q; q = q->next) {
+			if (now < q->deadline) {
+				ssl_deadline(q->deadline);
+				double hedge = hedge_time(c, q);
+				if (hedge && now >= hedge)
+					ssl_hedge(c, q);
+				else if (hedge)
+					ssl_deadline(hedge);
+				continue;
+			}
+			if (q->abandoned) {
+				rlogprintf("Warning: no response from %s, closing the connection\n", c->srv->name);
+				return -1;
+			}
+
+			if (q->lost) {
+				// nobody is waiting for the response
+				server_pool_result(c->srv, -1);
+			}
+			else if (q->hedge) {
+				// the copy on the other server takes over
+				server_pool_result(c->srv, -1);
+				ssl_unhedge(q);
+			}
+			else if (!q->keepalive) {
+				DnsQuery *r = malloc(sizeof(DnsQuery));
+				if (!r)
+					errExit("malloc");
+				memcpy(r, q, sizeof(DnsQuery));
+				c->srv->pending++;
+				ssl_retry(c, r);
+			}
+			q->abandoned = 1;
+			q->deadline = now + read_timeout(c->srv);
+			ssl_deadline(q->deadline);
+			expired++;
+		}
+
+		// the queries waiting behind the abandoned ones go to a different server; they were
+		// never sent here, nothing is recorded against the server
+		if (expired) {
+			while (c->queue) {
+				q = c->queue;
+				c->queue = q->next;
+				ssl_resend(c, q);
+			}
+			c->queue_last = NULL;
 		}
 	}
-	buf[len] = '\0';
 
-	// check 200 OK
-	char *ptr = strstr(buf, "200 OK");
-	if (!ptr) {
-		rlogprintf("[Pool] Warning: HTTP error, 200 OK not received\n");
-		printf("**************\n%s\n**************\n", buf);
-		fflush(0);
-		goto errout;
+	if (expired == 0)
+		return 0;
+	rlogprintf("Warning: %d %s timed out on %s\n", expired, (expired == 1) ? "query" : "queries", c->srv->name);
+	// send the RST_STREAM frames and the queries waiting for a free stream
+	return (c->h2 || c->srv->dot) ? ssl_send(c) : 0;
+}
+
+// run the event loop until all the queries are answered; used outside the resolver loop
+static void ssl_wait(void) {
+	while (1) {
+		int pending = 0;
+		int i;
+		for (i = 0; i < conn_len; i++)
+			pending += conn[i]->srv->pending;
+		if (pending == 0)
+			break;
+		ssl_timeout();
+		ssl_send_queued();
+		event_wait(NULL);
 	}
+}
 
-	// look for the end of http header
-	ptr = strstr(buf, "\r\n\r\n");
-	if (!ptr) {
-		rlogprintf("Warning: cannot parse HTTPS response, didn't recieve a full http header\n");
-		printf("**************\n%s\n**************\n", buf);
-		fflush(0);
-		goto errout;
+//**************************************************************************
+// public interface
+//**************************************************************************
+// open the session file and load the TLS sessions saved by the previous resolver process;
+// call it before chroot
+void ssl_session_load(void) {
+	char *fname;
+	if (asprintf(&fname, "%s/session-%d", PATH_RUN_FDNS, arg_id) == -1)
+		errExit("asprintf");
+	session_fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (session_fd == -1) {
+		rlogprintf("Warning: cannot open %s, TLS sessions will not be saved\n", fname);
+		free(fname);
+		return;
 	}
-	ptr += 4; // length of "\r\n\r\n"
-	ptrdiff_t hlen = ptr - buf; // +4 is the length of \r\n\r\n
-	*(ptr - 1) = 0;
-	if (arg_debug)
-		printf("(%d) http header:\n%s", arg_id, buf);
+	free(fname);
 
-	// look for Content-Length:
-	char *contlen = "Content-Length: ";
-	ptr = strcasestr(buf, contlen);
-	int datalen = 0;
-	if (!ptr) {
-		rlogprintf("Warning: cannot parse HTTPS response, content-length missing\n");
-		print_mem((uint8_t *) buf, len);
-		goto errout;
+	uint8_t buf[SESSION_FILE_MAX];
+	ssize_t len = pread(session_fd, buf, sizeof(buf), 0);
+	int i = 0;
+	while (i + 2 <= len) {
+		int nlen = (buf[i] << 8) | buf[i + 1];
+		i += 2;
+		if (i + nlen + 2 > len)
+			break;
+		char name[nlen + 1];
+		memcpy(name, buf + i, nlen);
+		name[nlen] = '\0';
+		i += nlen;
+		int slen = (buf[i] << 8) | buf[i + 1];
+		i += 2;
+		if (i + slen > len)
+			break;
+		const uint8_t *ptr = buf + i;
+		i += slen;
+
+		// sessions are kept only for the servers in the pool
+		int j;
+		for (j = 0; j < server_pool_len(); j++) {
+			DnsServer *srv = server_pool_entry(j);
+			if (strcmp(srv->name, name) == 0) {
+				SSL_SESSION *sess = d2i_SSL_SESSION(NULL, &ptr, slen);
+				if (sess) {
+					SSLConn *c = ssl_conn_get(srv);
+					if (c->session)
+						SSL_SESSION_free(c->session);
+					c->session = sess;
+					if (arg_debug)
+						printf("(%d) TLS session loaded for %s\n", arg_id, name);
+				}
+				break;
+			}
+		}
 	}
-	else {
-		ptr += strlen(contlen);
-		sscanf(ptr, "%d", &datalen);
-		if (datalen == 0) // we got a "Content-lenght: 0"; this is probably a HTTP error
-			return 0;
+}
+
+// open a connection to a single server; used by --test-server
+void ssl_open_server(DnsServer *srv) {
+	assert(srv);
+	SSLConn *c = ssl_conn_get(srv);
+	ssl_open_conn(c);
+	ssl_update_state();
+
+	// try to send a probe
+	ssl_probe_conn(c);
+	ssl_wait();
+}
+
+// --benchmark: open the connection to srv; returns the setup time in ms, -1 if failed
+double ssl_test_open(DnsServer *srv) {
+	assert(srv);
+	SSLConn *c = ssl_conn_get(srv);
+	double start = event_clock();
+	ssl_open_conn(c);
+	ssl_update_state();
+	if (c->state != SSL_OPEN)
+		return -1;
+	return event_clock() - start;
+}
+
+// --benchmark: send an A query for domain on the connection to srv and wait for the response;
+// returns the response time in ms, -1 if failed
+double ssl_test_query(DnsServer *srv, const char *domain) {
+	assert(srv);
+	assert(domain);
+	SSLConn *c = ssl_conn_get(srv);
+	if (c->state != SSL_OPEN)
+		return -1;
+
+	DnsQuery *q = malloc(sizeof(DnsQuery));
+	if (!q)
+		errExit("malloc");
+	memset(q, 0, sizeof(DnsQuery));
+	q->keepalive = 1;	// no client, the response is dropped
+
+	// header: random id, recursion desired, one question
+	uint8_t *ptr = q->query;
+	uint16_t id = rand();
+	*ptr++ = id >> 8;
+	*ptr++ = id & 0xff;
+	*ptr++ = 0x01;
+	*ptr++ = 0x00;
+	*ptr++ = 0x00;
+	*ptr++ = 0x01;
+	memset(ptr, 0, 6);
+	ptr += 6;
+
+	// question: domain name, type A, class IN
+	const char *label = domain;
+	while (*label) {
+		const char *end = strchr(label, '.');
+		int len = (end) ? end - label : (int) strlen(label);
+		if (len == 0 || len > 63 || ptr + len + 6 >= q->query + sizeof(q->query)) {
+			free(q);
+			return -1;
+		}
+		*ptr++ = len;
+		memcpy(ptr, label, len);
+		ptr += len;
+		label += len;
+		if (*label == '.')
+			label++;
+	}
+	*ptr++ = 0;
+	*ptr++ = 0x00;
+	*ptr++ = 0x01;
+	*ptr++ = 0x00;
+	*ptr++ = 0x01;
+	q->len = ptr - q->query;
+
+	// the query result is recorded by server_pool_result()
+	double start = event_clock();
+	ssl_query_add(c, q);
+	ssl_wait();
+	if (srv->failures)
+		return -1;
+	return event_clock() - start;
+}
+
+// open all the connections in the pool that are not already open, in parallel; the servers
+// taken out of the pool by the circuit breaker wait for the background probe, and the idle
+// connections for the next query
+void ssl_open(void) {
+	int cnt = server_pool_len();
+	int i;
+	for (i = 0; i < cnt; i++) {
+		SSLConn *c = ssl_conn_get(server_pool_entry(i));
+		if (c->state == SSL_OPEN || c->setup != SETUP_NONE || c->idle || c->srv->breaker != BREAKER_CLOSED)
+			continue;
+		ssl_open_async(c);
+	}
+	ssl_update_state();
+}
+
+// close all the connections in the pool; the queries in flight go to the fallback server
+void ssl_close(void) {
+	int i;
+	for (i = 0; i < conn_len; i++)
+		ssl_drop_conn(conn[i]);
+}
+
+// returns 1 if any pool connection was closed, 0 if all of them are open or idle
+int ssl_closed(void) {
+	int cnt = server_pool_len();
+	int i;
+	for (i = 0; i < cnt; i++) {
+		SSLConn *c = ssl_conn_get(server_pool_entry(i));
+		if (c->state != SSL_OPEN && c->setup == SETUP_NONE && !c->idle && c->srv->breaker == BREAKER_CLOSED)
+			return 1;
 	}
+	return 0;
+}
 
-	// do we need to read more data?
-	int totallen = (int) hlen + datalen;
+// send the query on the warm connection of the server picked by the pool; the response
+// is delivered later to resolver_reply()
+void ssl_dns_pool(const char* domain, DnsQuery *q) {
+	assert(domain);
+	assert(q);
+
+	DnsServer *srv = server_pool_get(domain);
+	assert(srv);
+	SSLConn *c = ssl_conn_get(srv);
 	if (arg_debug)
-		printf("(%d) SSL read len %d, totallen %d, datalen %d\n",
-		       arg_id, len, totallen, datalen);
-	if (totallen >= MAXBUF) {
-		rlogprintf("Warning: cannot parse HTTPS response, invalid length\n");
-		print_mem((uint8_t *) buf, len);
-		goto errout;
+		printf("(%d) resolving %s using %s\n", arg_id, domain, srv->name);
+	hedge_budget += arg_hedge_rate / 100.0;
+	if (hedge_budget > HEDGE_BURST)
+		hedge_budget = HEDGE_BURST;
+
+	if (c->state == SSL_OPEN) {
+		ssl_query_add(c, q);
+		return;
 	}
 
-	while (len < totallen) {
-		int rv = BIO_read(bio, buf + len, totallen - len);
+	// the connection went down: it is brought back in the background, and the query goes
+	// to a different server with an open connection; if there is none, the query waits for
+	// the handshake and it can go out as early data
+	// After a failed attempt the server is left alone for a while.
+	int reopen = c->setup == SETUP_NONE &&
+		(c->connect_fail == 0 || event_clock() - c->connect_fail >= SSL_REOPEN_TIMER * 1000);
+	SSLConn *next = ssl_next_open(c);
+	if (next) {
 		if (arg_debug)
-			printf("(%d) SSL read + %d\n", arg_id, rv);
-		if(rv <= 0) {
-			if(! BIO_should_retry(bio)) {
-				rlogprintf("Error: failed SSL read\n");
-				goto errout;
-			}
-			rv = BIO_read(bio, buf, MAXBUF);
-			if (arg_debug)
-				printf("(%d) SSL read + %d\n", arg_id, rv);
-			if(rv <= 0) {
-				rlogprintf("Error: SSL connection is probably closed\n");
-				goto errout;
-			}
+			printf("(%d) %s not connected, query sent to %s\n", arg_id, srv->name, next->srv->name);
+		ssl_query_add(next, q);
+		if (reopen) {
+			ssl_open_async(c);
+			ssl_update_state();
 		}
+		return;
+	}
 
-		len += rv;
+	ssl_query_add(c, q);
+	if (reopen) {
+		ssl_open_async(c);	// if the setup fails, the query goes to the fallback server
+		ssl_update_state();
 	}
+	else if (c->setup == SETUP_NONE)
+		ssl_drop_conn(c);	// the server is left alone after a failed connection attempt
+}
 
-	// copy the response in buf
-	memcpy(msg, buf + len - datalen, datalen);
-	if (arg_debug) {
-		printf("(%d) DNS data:\n", arg_id);
-		print_mem((uint8_t *) buf, datalen);
-		printf("(%d) *** SSL transaction end ***\n", arg_id);
+// expire queries and connections; call it on every event loop pass, before ssl_send_queued()
+void ssl_timeout(void) {
+	if (next_deadline == 0)
+		return;
+	double now = event_clock();
+	if (now < next_deadline) {
+		event_wakeup(next_deadline);
+		return;
 	}
 
-	//
-	// partial response parsing
-	//
-	printf("LOADING INTO DB\n");
-	if (lint_rx(msg, datalen)) {
-		if (lint_error() == DNSERR_NXDOMAIN) {
-			cache_set_reply(msg, datalen, CACHE_TTL_ERROR);
-			printf("Partial load\n");
-			return datalen;
+	next_deadline = 0;
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		SSLConn *c = conn[i];
+		if (c->state == SSL_OPEN && ssl_conn_timeout(c, now))
+			ssl_fail_conn(c);
+		else if (c->setup != SETUP_NONE) {
+			if (now >= c->setup_deadline) {
+				rlogprintf("Warning: connection to %s timed out\n", c->srv->name);
+				ssl_setup_done(c, -1);
+			}
+			else
+				ssl_deadline(c->setup_deadline);
 		}
-
-		logprintf("Error: RX %s\n", lint_err2str());
-		return 0;
 	}
+	if (hold)
+		ssl_hold_timeout(now);
+	if (next_deadline)
+		event_wakeup(next_deadline);
+}
 
-	printf("LOADING INTO DB PART 2\n");
-	// cache the response and exit
-	cache_set_reply(msg, datalen, arg_cache_ttl);
-	return datalen;
-
-errout:
-	ssl_close();
-	return 0;
+// send the queries added during the last event loop pass
+void ssl_send_queued(void) {
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		SSLConn *c = conn[i];
+		if (c->batch && c->state == SSL_OPEN && ssl_send(c))
+			ssl_fail_conn(c);
+	}
 }
 
+// send a DNS query on all the open connections and wait for the responses; used by --test-server
 void ssl_keepalive(void) {
-	if (arg_debug)
-		printf("(%d) send keepalive\n", arg_id);
-	uint8_t msg[3000] = { // www.example.com
-		0x00, 0x00, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, 0x03, 0x77, 0x77, 0x77,
-		0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,  0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00,
-		0x01
-	};
-	uint8_t buf[MAXBUF];
-	int len = 33;
+	int i;
+	for (i = 0; i < conn_len; i++)
+		ssl_probe_conn(conn[i]);
+	ssl_wait();
+	ssl_update_state();
+}
 
-	memcpy(buf, msg, len);
-	
-	if (ssl_state == SSL_OPEN){
-		ssl_dns(buf, 33);
+// called every second: send a keepalive on the connections with the keepalive timer expired,
+// and a background probe to the servers taken out of the pool by the circuit breaker, or
+// not measured recently by the hash scheduler
+void ssl_keepalive_timer(void) {
+	int i;
+	for (i = 0; i < conn_len; i++) {
+		SSLConn *c = conn[i];
+		if (server_pool_probe_due(c->srv)) {
+			if (arg_debug)
+				printf("(%d) background probe for %s\n", arg_id, c->srv->name);
+			// the result of a new connection comes back in ssl_setup_done()
+			if (c->state == SSL_OPEN)
+				ssl_probe_conn(c);
+			else if (c->setup == SETUP_NONE)
+				ssl_open_async(c);
+		}
+		else if (c->state == SSL_OPEN && server_pool_sample_due(c->srv))
+			ssl_probe_conn(c);
+		else if (c->state == SSL_OPEN && --c->keepalive_cnt <= 0)
+			ssl_keepalive_conn(c);
 	}
+	ssl_update_state();
 }
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2019-2020 FDNS Authors
+ *
+ * This file is part of fdns project
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "fdns.h"
+
+// hierarchical timer wheel with a resolution of one second, used for the cache and
+// the request database expiry; the wheel is advanced by the one-second tick of the event
+// loop, and each tick touches only the timers that expire or move to a lower level
+//
+// level 0 covers the next 64 seconds, each level above is 64 times coarser; the timers
+// in a slot of a higher level are moved down when the lower level wraps around
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4	// about 194 days, longer timers are clamped
+#define WHEEL_MAX ((1u << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static WheelTimer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint32_t now = 0;	// current tick
+
+static void wheel_insert(WheelTimer *t) {
+	uint32_t delta = t->expire - now;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= (1u << (WHEEL_BITS * (level + 1))))
+		level++;
+	WheelTimer **slot = &wheel[level][(t->expire >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+// remove the timer; nothing happens if the timer is not running
+void wheel_del(WheelTimer *t) {
+	assert(t);
+	if (!t->pprev)
+		return;
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+// start the timer, or restart it if already running; the handler is called in seconds
+void wheel_add(WheelTimer *t, unsigned seconds, WheelHandler handler) {
+	assert(t);
+	assert(handler);
+	wheel_del(t);
+	if (seconds == 0)
+		seconds = 1;
+	if (seconds > WHEEL_MAX)
+		seconds = WHEEL_MAX;
+	t->expire = now + seconds;
+	t->handler = handler;
+	wheel_insert(t);
+}
+
+// move the timers in the current slot of this level to the lower levels
+static void wheel_cascade(int level) {
+	unsigned index = (now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	WheelTimer *t = wheel[level][index];
+	wheel[level][index] = NULL;
+	while (t) {
+		WheelTimer *next = t->next;
+		wheel_insert(t);
+		t = next;
+	}
+}
+
+// advance the wheel by one second and run the handlers of the expired timers;
+// call it on the one-second tick of the event loop
+void wheel_tick(void) {
+	now++;
+	int level;
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if ((now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+			break;
+		wheel_cascade(level);
+	}
+
+	// the handlers can start new timers, they never land in this slot
+	WheelTimer **slot = &wheel[0][now & WHEEL_MASK];
+	WheelTimer *t;
+	while ((t = *slot) != NULL) {
+		wheel_del(t);
+		t->handler(t);
+	}
+}
@@ -40,6 +40,9 @@ echo "TESTING: test-url (test/fdns/test-url.exp)"
 echo "TESTING: test-servers=anycast (test/fdns/test-servers-anycast.exp)"
 ./test-servers-anycast.exp
 
+echo "TESTING: benchmark=anycast (test/fdns/benchmark-anycast.exp)"
+./benchmark-anycast.exp
+
 echo "TESTING: monitor (test/fdns/monitor.exp)"
 ./monitor.exp
 